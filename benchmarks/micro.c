@@ -0,0 +1,407 @@
+// Drives ValTab, arrays, the buffer kernels, the lexer, the compile
+// cache, snapshots, the allocator and arraygrow directly so changes to
+// src/valtab.c, src/buf.c, src/parser.c, src/cache.c, src/image.c,
+// src/mem.c and src/util.c can be measured without the rest of the VM
+// in the way.
+//
+// usage: bin/microbench [filter]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <star/mem.h>
+#include <star/util.h>
+#include <star/star.h>
+#include <star/cache.h>
+#include <star/image.h>
+#include <star/buf.h>
+
+static char *filter = 0;
+static volatile long sink;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned rnd(unsigned *state) {
+    *state = *state * 1103515245 + 12345;
+    return *state >> 8;
+}
+
+// loops run in batches of 1024 until they've taken this long
+#define MINSECS 0.2
+
+static int enabled(char *name) {
+    return !filter || strstr(name, filter);
+}
+
+// ns/op plus the working set the loop touched, the point where it
+// outgrows a cache level is where ns/op jumps
+static void report(char *name, double secs, long ops, long wset) {
+    printf("%-34s %10.2f ns/op %10.2f Mops/s", name,
+            secs * 1e9 / ops, ops / secs / 1e6);
+    if (wset) printf(" %10.1f KB", wset / 1024.0);
+    printf("\n");
+}
+
+static ObjString **mkkeys(int n, char *prefix) {
+    ObjString **keys = xmalloc(n * sizeof(ObjString *));
+    char buf[64];
+    for (int i = 0; i < n; i++) {
+        snprintf(buf, sizeof(buf), "%s%i", prefix, i);
+        keys[i] = (ObjString *)strval(buf).as.obj;
+    }
+    return keys;
+}
+
+static void benchvaltab(int n, int hitpct) {
+    char name[64];
+    snprintf(name, sizeof(name), "valtab n=%i hit=%i%%", n, hitpct);
+    if (!enabled(name)) return;
+    ObjString **keys = mkkeys(n, "key");
+    ObjString **miss = mkkeys(n, "miss");
+    int before = memused();
+    ValTab *vt = newvaltab();
+    double t = now();
+    for (int i = 0; i < n; i++)
+        valtabset(vt, keys[i], numval(i));
+    double set = now() - t;
+    int wset = memused() - before;
+    long ops = 0;
+    unsigned seed = 1;
+    Value v;
+    long found = 0;
+    t = now();
+    while (now() - t < MINSECS) {
+        for (int i = 0; i < 1024; i++, ops++) {
+            int k = rnd(&seed) % n;
+            ObjString *key = rnd(&seed) % 100 < hitpct ? keys[k] : miss[k];
+            found += valtabget(vt, key, &v);
+        }
+    }
+    double get = now() - t;
+    sink = found;
+    report(name, get, ops, wset);
+    if (hitpct == 100) {
+        snprintf(name, sizeof(name), "valtabset n=%i", n);
+        report(name, set, n, wset);
+    }
+    freevaltab(vt);
+    for (int i = 0; i < n; i++) {
+        xfree(keys[i]);
+        xfree(miss[i]);
+    }
+    xfree(keys);
+    xfree(miss);
+}
+
+// random reads by position, from an array and from a table keyed by the
+// number's text, the only way to index a table by number
+static void benchindex(int n) {
+    char name[64];
+    snprintf(name, sizeof(name), "array get %i", n);
+    if (!enabled(name)) return;
+    Value varr = arrval(0);
+    ObjArr *arr = (ObjArr *)varr.as.obj;
+    ValTab *vt = newvaltab();
+    ObjString **keys = mkkeys(n, "");
+    for (int i = 0; i < n; i++) {
+        arrpush(arr, numval(i));
+        valtabset(vt, keys[i], numval(i));
+    }
+    unsigned seed = 1;
+    long ops = 0;
+    double sum = 0;
+    double t = now();
+    while (now() - t < MINSECS) {
+        for (int i = 0; i < 1024; i++, ops++)
+            sum += arr->items[rnd(&seed) % n].as.num;
+    }
+    report(name, now() - t, ops, n * sizeof(Value));
+    ValTab *nt = newvaltab();
+    for (int i = 0; i < n; i++)
+        valtabsetnum(nt, i, numval(i));
+    snprintf(name, sizeof(name), "table get num key %i", n);
+    Value v;
+    seed = 1;
+    ops = 0;
+    t = now();
+    while (now() - t < MINSECS) {
+        for (int i = 0; i < 1024; i++, ops++) {
+            valtabgetnum(nt, rnd(&seed) % n, &v);
+            sum += v.as.num;
+        }
+    }
+    report(name, now() - t, ops,
+            nt->narr * sizeof(Value) + nt->nslots * sizeof(Slot));
+    freevaltab(nt);
+    snprintf(name, sizeof(name), "table get synthesized key %i", n);
+    char key[16];
+    seed = 1;
+    ops = 0;
+    t = now();
+    while (now() - t < MINSECS) {
+        for (int i = 0; i < 1024; i++, ops++) {
+            int len = snprintf(key, sizeof(key), "%u", rnd(&seed) % n);
+            valtabgetn(vt, key, len, strhashn(key, len), &v);
+            sum += v.as.num;
+        }
+    }
+    report(name, now() - t, ops, vt->nslots * sizeof(Slot));
+    sink += sum;
+    for (int i = 0; i < n; i++)
+        xfree(keys[i]);
+    xfree(keys);
+    freevaltab(vt);
+    xfree(arr->items);
+    xfree(arr);
+}
+
+// whole-buffer kernels, one op is one element
+static void benchbuf(int n) {
+    char name[64];
+    snprintf(name, sizeof(name), "buf sum %i", n);
+    if (!enabled(name)) return;
+    double *a = xmalloc(n * sizeof(double));
+    double *b = xmalloc(n * sizeof(double));
+    for (int i = 0; i < n; i++) {
+        a[i] = i;
+        b[i] = n - i;
+    }
+    double sum = 0;
+    long ops = 0;
+    double t = now();
+    while (now() - t < MINSECS) {
+        sum += bufsum(a, n);
+        ops += n;
+    }
+    report(name, now() - t, ops, n * sizeof(double));
+    snprintf(name, sizeof(name), "buf dot %i", n);
+    ops = 0;
+    t = now();
+    while (now() - t < MINSECS) {
+        sum += bufdot(a, b, n);
+        ops += n;
+    }
+    report(name, now() - t, ops, 2 * n * sizeof(double));
+    snprintf(name, sizeof(name), "buf add %i", n);
+    ops = 0;
+    t = now();
+    while (now() - t < MINSECS) {
+        bufadd(b, a, b, n);
+        ops += n;
+    }
+    report(name, now() - t, ops, 2 * n * sizeof(double));
+    sink += sum;
+    xfree(a);
+    xfree(b);
+}
+
+static char *gensrc(int nfuncs) {
+    int cap = 256, len = 0;
+    char *src = xmalloc(cap);
+    char buf[512];
+    for (int i = 0; i < nfuncs; i++) {
+        int n = snprintf(buf, sizeof(buf),
+                "var obj%i = {\n"
+                "    .name = \"object number %i\",\n"
+                "    .count = %i,\n"
+                "    .get = function(this, arg%i) {\n"
+                "        if (this.count < arg%i && arg%i != nil) {\n"
+                "            return this.name + \"suffix\"\n"
+                "        }\n"
+                "        return this.count * 2 + %i\n"
+                "    }\n"
+                "}\n", i, i, i, i % 50, i % 50, i % 50, i);
+        while (len + n + 1 > cap) cap *= 2;
+        src = xrealloc(src, cap);
+        memcpy(src + len, buf, n);
+        len += n;
+    }
+    src[len] = 0;
+    return src;
+}
+
+static void benchlex(int nfuncs) {
+    char name[64];
+    snprintf(name, sizeof(name), "tokenize %i defs", nfuncs);
+    if (!enabled(name)) return;
+    char *src = gensrc(nfuncs);
+    long len = strlen(src);
+    double t = now();
+    int ntoks = tokenize(src);
+    double secs = now() - t;
+    report(name, secs, ntoks, 0);
+    printf("%-34s %10.2f MB/s %10i tokens\n", "", len / secs / 1e6, ntoks);
+    xfree(src);
+}
+
+// one compile of a big script, ns/op is per line and stays flat as the
+// script grows when compile time is linear in its size
+static void benchcompile(int nfuncs) {
+    char name[64];
+    snprintf(name, sizeof(name), "compile %i lines", nfuncs * 10);
+    if (!enabled(name)) return;
+    char *src = gensrc(nfuncs);
+    double t = now();
+    ObjFunc *fn = compile(src);
+    report(name, now() - t, nfuncs * 10, 0);
+    freefunc(fn);
+    xfree(src);
+}
+
+// a hit only hashes and compares the source
+static void benchcache(int nfuncs) {
+    char name[64];
+    snprintf(name, sizeof(name), "compile %i defs", nfuncs);
+    if (!enabled(name)) return;
+    char *src = gensrc(nfuncs);
+    Vm *vm = newvm();
+    ObjFunc *fn;
+    long ops = 0;
+    double t = now();
+    while (now() - t < MINSECS) {
+        starcompile(vm, src, &fn);
+        freefunc(fn);
+        ops++;
+    }
+    report(name, now() - t, ops, 0);
+    snprintf(name, sizeof(name), "cachecompile hit %i defs", nfuncs);
+    Cache *c = newcache(1 << 24);
+    ops = 0;
+    t = now();
+    while (now() - t < MINSECS) {
+        for (int i = 0; i < 64; i++, ops++) {
+            cachecompile(c, vm, src, &fn);
+            cacherelease(c, fn);
+        }
+    }
+    report(name, now() - t, ops, cachestats(c).bytes);
+    freecache(c);
+    freevm(vm);
+    xfree(src);
+}
+
+// what a request pays to get the state an init script builds, by
+// running the script or by mapping a snapshot of what it left
+static void benchsnapshot(int nfuncs) {
+    char name[64];
+    snprintf(name, sizeof(name), "run init %i defs", nfuncs);
+    if (!enabled(name)) return;
+    char *src = gensrc(nfuncs);
+    char path[] = "/tmp/starsnapXXXXXX";
+    close(mkstemp(path));
+    Vm *vm = newvm();
+    Scope *scope = newscope();
+    ObjFunc *fn;
+    starcompilein(vm, src, scope, 1, &fn);
+    long ops = 0;
+    double t = now();
+    while (now() - t < MINSECS) {
+        starrun(vm, fn);
+        resetvm(vm);
+        ops++;
+    }
+    report(name, now() - t, ops, 0);
+    starrun(vm, fn);
+    savesnapshot(vm, scope, path);
+    resetvm(vm);
+    Image *img = loadimage(path);
+    snprintf(name, sizeof(name), "restore snapshot %i defs", nfuncs);
+    ops = 0;
+    t = now();
+    while (now() - t < MINSECS) {
+        Image *clone = cloneimage(img);
+        starrestore(vm, clone);
+        resetvm(vm);
+        freeimage(clone);
+        ops++;
+    }
+    report(name, now() - t, ops, 0);
+    freeimage(img);
+    unlink(path);
+    freescope(scope);
+    freefunc(fn);
+    freevm(vm);
+    xfree(src);
+}
+
+static void benchalloc(int live, int maxsz) {
+    char name[64];
+    snprintf(name, sizeof(name), "xmalloc/xfree live=%i size<=%i", live, maxsz);
+    if (!enabled(name)) return;
+    int before = memused();
+    void **ptrs = xmalloc(live * sizeof(void *));
+    unsigned seed = 7;
+    for (int i = 0; i < live; i++)
+        ptrs[i] = xmalloc(1 + rnd(&seed) % maxsz);
+    int wset = memused() - before;
+    long ops = 0;
+    double t = now();
+    while (now() - t < MINSECS) {
+        for (int i = 0; i < 1024; i++, ops++) {
+            int k = rnd(&seed) % live;
+            xfree(ptrs[k]);
+            ptrs[k] = xmalloc(1 + rnd(&seed) % maxsz);
+        }
+    }
+    report(name, now() - t, ops, wset);
+    for (int i = 0; i < live; i++)
+        xfree(ptrs[i]);
+    xfree(ptrs);
+}
+
+static void benchgrow(int n, int elemsz) {
+    char name[64];
+    snprintf(name, sizeof(name), "arraygrow n=%i elemsz=%i", n, elemsz);
+    if (!enabled(name)) return;
+    long ops = 0;
+    int before = memused();
+    int wset = 0;
+    double t = now();
+    while (now() - t < MINSECS) {
+        char *array = newarray(elemsz);
+        for (int i = 0; i < n; i++, ops++) {
+            array = arraygrow(array, i + 1);
+            memset(array + i * elemsz, i, elemsz);
+        }
+        wset = memused() - before;
+        freearray(array);
+    }
+    report(name, now() - t, ops, wset);
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) filter = argv[1];
+    int sizes[] = {8, 64, 1024, 16384, 262144};
+    for (int i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+        benchvaltab(sizes[i], 100);
+        benchvaltab(sizes[i], 50);
+        benchvaltab(sizes[i], 0);
+    }
+    benchindex(1024);
+    benchindex(262144);
+    benchbuf(4096);
+    benchbuf(1048576);
+    benchlex(1000);
+    benchlex(10000);
+    benchcompile(2500);
+    benchcompile(5000);
+    benchcompile(10000);
+    benchcache(10);
+    benchcache(100);
+    benchsnapshot(10);
+    benchsnapshot(100);
+    benchsnapshot(1000);
+    benchalloc(64, 64);
+    benchalloc(65536, 64);
+    benchalloc(65536, 4096);
+    benchgrow(16, sizeof(Value));
+    benchgrow(4096, sizeof(Value));
+    benchgrow(4096, 1);
+    return 0;
+}
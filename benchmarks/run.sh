@@ -0,0 +1,72 @@
+#!/bin/sh
+# Runs every benchmarks/*.sr RUNS times and reports median and p95 wall
+# time, then does one extra profiled run for the instruction count and
+# the peak of the VM heap. Timings are compared against BASELINE when it
+# exists, `run.sh -s` overwrites it with this run's medians.
+#
+# usage: benchmarks/run.sh [-s] [bench ...]
+
+BIN=${BIN:-bin/star}
+RUNS=${RUNS:-5}
+DIR=$(dirname "$0")
+BASELINE=${BASELINE:-$DIR/baseline.txt}
+
+save=0
+if [ "$1" = "-s" ]; then
+    save=1
+    shift
+fi
+if [ $# -eq 0 ]; then
+    set -- "$DIR"/*.sr
+fi
+
+now() {
+    date +%s%N
+}
+
+results=$(mktemp)
+trap 'rm -f "$results"' EXIT
+
+printf "%-10s %10s %10s %12s %10s %10s %8s\n" \
+    bench "median ms" "p95 ms" "Mins/s" "peak KB" "base ms" delta
+for file in "$@"; do
+    name=$(basename "$file" .sr)
+    times=""
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        start=$(now)
+        if ! "$BIN" -q "$file" > /dev/null; then
+            echo "*** $file failed" >&2
+            exit 1
+        fi
+        end=$(now)
+        times="$times $(( (end - start) / 1000 ))"
+        i=$((i + 1))
+    done
+    stats=$("$BIN" -p "$file" 2> /dev/null)
+    ins=$(echo "$stats" | awk '/^instructions:/ { print $2 }')
+    peak=$(echo "$stats" | awk '/peak$/ { p = $(NF - 1) } END { print p }')
+    base=""
+    if [ -f "$BASELINE" ]; then
+        base=$(awk -v n="$name" '$1 == n { print $2 }' "$BASELINE")
+    fi
+    echo $times | tr ' ' '\n' | sort -n | awk \
+        -v name="$name" -v ins="${ins:-0}" -v peak="${peak:-0}" \
+        -v base="$base" -v results="$results" '
+        { t[NR] = $1 }
+        END {
+            med = NR % 2 ? t[(NR + 1) / 2] : (t[NR / 2] + t[NR / 2 + 1]) / 2
+            p = int(NR * 0.95 + 0.999)
+            med /= 1000
+            p95 = t[p] / 1000
+            mips = ins && med ? ins / med / 1000 : 0
+            delta = base ? sprintf("%+.1f%%", (med - base) / base * 100) : "-"
+            printf "%-10s %10.1f %10.1f %12.1f %10.1f %10s %8s\n", name, med,
+                p95, mips, peak / 1024, base ? base : "-", delta
+            printf "%s %.1f\n", name, med >> results
+        }'
+done
+if [ $save -eq 1 ]; then
+    cp "$results" "$BASELINE"
+    echo "saved baseline to $BASELINE"
+fi
@@ -0,0 +1,104 @@
+// Compiles one script and runs it as a batch of jobs on 1 to N threads,
+// every thread with its own vm and all of them sharing the compiled
+// function. The batch size stays the same so ideal scaling halves the
+// time when the threads double.
+//
+// usage: bin/scalebench [maxthreads] [file]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <star/mem.h>
+#include <star/util.h>
+#include <star/star.h>
+#include <star/pool.h>
+
+static char *DEFSRC =
+    "var m = {\n"
+    "    .fib = function(this, n) {\n"
+    "        if (n < 2) return n\n"
+    "        return this:fib(n - 1) + this:fib(n - 2)\n"
+    "    }\n"
+    "}\n"
+    "var s = \"\"\n"
+    "var i = 0\n"
+    "while (i < 200) {\n"
+    "    var t = {.n = i, .name = \"job\"}\n"
+    "    s = t.name + i\n"
+    "    i = i + 1\n"
+    "}\n"
+    "return m:fib(20)\n";
+
+// jobs per thread at the highest thread count
+#define JOBSPERTHREAD 8
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *readfile(char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        printf("*** can't open %s\n", path);
+        exit(1);
+    }
+    fseek(fp, 0, SEEK_END);
+    int size = ftell(fp);
+    char *src = xmalloc(size + 1);
+    rewind(fp);
+    fread(src, size, 1, fp);
+    src[size] = 0;
+    fclose(fp);
+    return src;
+}
+
+int main(int argc, char **argv) {
+    int maxthreads = argc > 1 ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (maxthreads < 1) maxthreads = 1;
+    char *src = argc > 2 ? readfile(argv[2]) : 0;
+    Vm *vm = newvm();
+    ObjFunc *fn;
+    if (starcompile(vm, src ? src : DEFSRC, &fn) != STAR_OK) {
+        printf("*** %s\n", starerror(vm));
+        return 1;
+    }
+    int njobs = maxthreads * JOBSPERTHREAD;
+    Job *jobs = xmalloc(njobs * sizeof(Job));
+    printf("%i jobs per batch\n", njobs);
+    printf("%8s %10s %10s %8s %8s\n", "threads", "secs", "jobs/s", "speedup", "eff");
+    double base = 0;
+    for (int n = 1; n <= maxthreads; n = n < maxthreads && n * 2 > maxthreads ? maxthreads : n * 2) {
+        Pool *p = newpool(n);
+        memset(jobs, 0, njobs * sizeof(Job));
+        for (int i = 0; i < njobs; i++)
+            jobs[i].fn = fn;
+        double t = now();
+        runjobs(p, jobs, njobs);
+        double secs = now() - t;
+        freepool(p);
+        for (int i = 0; i < njobs; i++) {
+            if (jobs[i].status != STAR_OK) {
+                printf("*** job %i: %s\n", i, jobs[i].err);
+                return 1;
+            }
+            Value r = jobs[i].result, r0 = jobs[0].result;
+            if (r.type != r0.type || (r.type == V_NUM && r.as.num != r0.as.num)) {
+                printf("*** job %i: result differs from job 0\n", i);
+                return 1;
+            }
+        }
+        if (n == 1) base = secs;
+        printf("%8i %10.3f %10.1f %7.2fx %7.0f%%\n", n, secs, njobs / secs,
+                base / secs, 100 * base / secs / n);
+        if (n == maxthreads) break;
+    }
+    xfree(jobs);
+    freefunc(fn);
+    freevm(vm);
+    if (src) xfree(src);
+    return 0;
+}
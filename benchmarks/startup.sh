@@ -0,0 +1,75 @@
+#!/bin/sh
+# Generates scripts with N object definitions and compares how long
+# bin/star takes to start from the source against starting from an
+# image written by -c. The scripts only define things, so the time is
+# almost all startup.
+#
+# usage: benchmarks/startup.sh [defs ...]
+
+BIN=${BIN:-bin/star}
+RUNS=${RUNS:-5}
+
+if [ $# -eq 0 ]; then
+    set -- 1000 10000
+fi
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+now() {
+    date +%s%N
+}
+
+# median wall time of RUNS runs in ms
+median() {
+    times=""
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        start=$(now)
+        if ! "$BIN" -q "$1" > /dev/null; then
+            echo "*** $1 failed" >&2
+            exit 1
+        fi
+        end=$(now)
+        times="$times $(( (end - start) / 1000 ))"
+        i=$((i + 1))
+    done
+    echo $times | tr ' ' '\n' | sort -n | awk '
+        { t[NR] = $1 }
+        END {
+            med = NR % 2 ? t[(NR + 1) / 2] : (t[NR / 2] + t[NR / 2 + 1]) / 2
+            printf "%.1f", med / 1000
+        }'
+}
+
+printf "%8s %10s %10s %10s %10s %8s\n" \
+    defs "src KB" "image KB" "src ms" "image ms" speedup
+for n in "$@"; do
+    src=$tmp/defs$n.sr
+    img=$tmp/defs$n.sbc
+    awk -v n="$n" 'BEGIN {
+        for (i = 0; i < n; i++) {
+            printf "var obj%d = {\n", i
+            printf "    .name = \"object number %d\",\n", i
+            printf "    .count = %d,\n", i
+            printf "    .get = function(this, arg) {\n"
+            printf "        if (this.count < arg && arg != nil) {\n"
+            printf "            return this.name + \"suffix\"\n"
+            printf "        }\n"
+            printf "        return this.count * 2 + %d\n", i
+            printf "    }\n"
+            printf "}\n"
+        }
+    }' > "$src"
+    if ! "$BIN" -q -c "$img" "$src"; then
+        echo "*** can't write $img" >&2
+        exit 1
+    fi
+    tsrc=$(median "$src")
+    timg=$(median "$img")
+    awk -v n="$n" -v ssrc="$(wc -c < "$src")" -v simg="$(wc -c < "$img")" \
+        -v tsrc="$tsrc" -v timg="$timg" 'BEGIN {
+        printf "%8d %10.1f %10.1f %10.1f %10.1f %7.1fx\n", n, ssrc / 1024,
+            simg / 1024, tsrc, timg, timg ? tsrc / timg : 0
+    }'
+done
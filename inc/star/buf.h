@@ -0,0 +1,18 @@
+#pragma once
+
+// kernels over packed doubles. dst may be one of the inputs, the ones
+// taking k use it in place of a second buffer. Masks are 1 where the
+// comparison holds and 0 where it doesn't. min and max are NaN if any
+// element is.
+double bufsum(double *a, int n);
+double bufmin(double *a, int n);
+double bufmax(double *a, int n);
+double bufdot(double *a, double *b, int n);
+void bufadd(double *dst, double *a, double *b, int n);
+void bufaddk(double *dst, double *a, double k, int n);
+void bufmul(double *dst, double *a, double *b, int n);
+void bufscale(double *dst, double *a, double k, int n);
+void buflt(double *dst, double *a, double *b, int n);
+void bufltk(double *dst, double *a, double k, int n);
+void bufgt(double *dst, double *a, double *b, int n);
+void bufgtk(double *dst, double *a, double k, int n);
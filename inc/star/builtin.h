@@ -0,0 +1,7 @@
+#pragma once
+
+#include <star/star.h>
+
+// registers the builtin module with def: clock, math, string and table
+// helpers, prototypes and the buffer kernels
+void defbuiltins(void (*def)(char *name, int arity, NativeFn fn));
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdint.h>
+#include <star/star.h>
+
+typedef struct Cache Cache;
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    int entries;
+    int bytes;
+    int maxbytes;
+} CacheStats;
+
+// compiled functions keyed by their source text, least recently used
+// ones are dropped once the cache holds more than maxbytes
+STAR_API Cache *newcache(int maxbytes);
+STAR_API void freecache(Cache *c);
+STAR_API int cachecompile(Cache *c, Vm *vm, char *src, ObjFunc **fn);
+STAR_API void cacherelease(Cache *c, ObjFunc *fn);
+STAR_API CacheStats cachestats(Cache *c);
+STAR_API void printcache(Cache *c);
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <star/star.h>
+
+// bump when the layout of anything stored in an image changes
+#define IMAGE_VERSION 13
+
+typedef struct Image Image;
+
+// an image holds a compiled script, a snapshot of a vm's top-level
+// locals and everything they reach, or both. What's loaded from one
+// belongs to it and is released with freeimage, never with freefunc.
+int isimage(char *path);
+void saveimage(ObjFunc *fn, char *path);
+void savesnapshot(Vm *vm, Scope *scope, char *path);
+STAR_API Image *loadimage(char *path);
+STAR_API Image *cloneimage(Image *img);
+STAR_API ObjFunc *imagefunc(Image *img);
+STAR_API Scope *imagescope(Image *img);
+STAR_API void starrestore(Vm *vm, Image *img);
+STAR_API void freeimage(Image *img);
+
+STAR_API int starsave(Vm *vm, ObjFunc *fn, char *path);
+STAR_API int starsnapshot(Vm *vm, Scope *scope, char *path);
+STAR_API int starload(Vm *vm, char *path, Image **img);
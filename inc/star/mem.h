@@ -5,3 +5,4 @@ void *xrealloc(void *ptr, int size);
 void xfree(void *ptr);
 
 void printmem();
+int memused();
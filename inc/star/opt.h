@@ -0,0 +1,24 @@
+#pragma once
+
+#include <star/star.h>
+
+// call sites looked at and inlined by optimize on this thread, guarded
+// ones are also counted as inlined, and tables kept in registers
+typedef struct {
+    int sites;
+    int inlined;
+    int guarded;
+    int tables;
+} OptStats;
+
+// set to 0 before compiling to leave every call and table as it is
+extern int optinline;
+
+// inlines small leaf functions where the callee is known: a function
+// constant in a local, or speculatively one from a field of a table
+// literal, checked by GUARD when it runs. Then table literals that never
+// leave the chunk are replaced by registers for their fields. depth is
+// the number of locals on the stack when c starts, with keep they're
+// still there after it returns.
+void optimize(Chunk *c, int depth, int keep);
+OptStats optstats();
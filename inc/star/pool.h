@@ -0,0 +1,18 @@
+#pragma once
+
+#include <star/star.h>
+
+typedef struct Pool Pool;
+
+// result is the top of the stack when it isn't an object, objects are
+// owned by the worker's vm and are gone by the time runjobs returns
+typedef struct {
+    ObjFunc *fn;
+    int status;
+    Value result;
+    char err[256];
+} Job;
+
+STAR_API Pool *newpool(int nthreads);
+STAR_API void freepool(Pool *p);
+STAR_API void runjobs(Pool *p, Job *jobs, int njobs);
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <star/star.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline uint64_t profclock() { return __rdtsc(); }
+#else
+#include <time.h>
+static inline uint64_t profclock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+#endif
+
+typedef struct Sampler Sampler;
+
+typedef struct {
+    uint64_t count;
+    uint64_t cycles;
+} ProfCount;
+
+typedef struct {
+    char *name;
+    int nins;
+    char *ops;
+    ProfCount *ins;
+    uint64_t calls;
+} ProfChunk;
+
+// cycles are self time, a CALL doesn't include the time spent in the callee
+struct Prof {
+    ProfCount ops[NOPS];
+    uint64_t pairs[NOPS][NOPS];
+    ProfChunk *chunks;
+    int nchunks;
+    uint64_t callee;
+};
+
+Prof *newprof();
+void freeprof(Prof *p);
+ProfChunk *profenter(Prof *p, Chunk *c);
+void profreport(Prof *p, FILE *fp);
+void profjson(Prof *p, FILE *fp);
+
+static inline void profins(Prof *p, ProfChunk *pc, int ip, int op,
+        int prevop, uint64_t t0) {
+    uint64_t dt = profclock() - t0;
+    if (op == OP_CALL) dt -= p->callee;
+    pc->ins[ip].count++;
+    pc->ins[ip].cycles += dt;
+    p->ops[op].count++;
+    p->ops[op].cycles += dt;
+    p->pairs[prevop][op]++;
+}
+
+Sampler *startsampler(Vm *vm, int hz);
+void stopsampler(Sampler *s);
+void writefolded(Sampler *s, FILE *fp);
+void samplerstats(Sampler *s, FILE *fp);
+void freesampler(Sampler *s);
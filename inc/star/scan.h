@@ -0,0 +1,17 @@
+#pragma once
+
+// character classes for the lexer, _ counts as alpha
+enum {
+    C_SPACE = 1,
+    C_DIGIT = 2,
+    C_ALPHA = 4,
+};
+
+extern const unsigned char CCLASS[256];
+
+// each returns the first char in [s, end) that isn't part of the run,
+// or end
+char *skipspace(char *s, char *end);
+char *skipident(char *s, char *end);
+char *skipdigits(char *s, char *end);
+char *findquote(char *s, char *end);
@@ -1,6 +1,15 @@
 #pragma once
 
-#define VALS(V) V(NONE) V(NUM) V(BOOL) V(NIL) V(OBJ)
+#include <limits.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// libstar is built with hidden visibility, only these names are exported
+#define STAR_API __attribute__((visibility("default")))
+
+#define VALS(V) V(NONE) V(NUM) V(BOOL) V(NIL) V(OBJ) V(DEAD)
 
 enum {
 #define V(name) V_ ## name,
@@ -8,23 +17,65 @@ enum {
 #undef V
 };
 
-typedef struct ValTab ValTab;
+#define OPS(OP) OP(NONE) OP(RET) OP(CONS) OP(NIL) OP(NEW) \
+        OP(ADD) OP(SUB) OP(MUL) OP(DIV) \
+        OP(NEG) \
+        OP(PRINT) \
+        OP(POP) \
+        OP(GET_LOCAL) OP(SET_LOCAL) \
+        OP(GET_FIELD) OP(SET_FIELD) \
+        OP(CJMP) OP(JMP) \
+        OP(NOP) \
+        OP(NOT) \
+        OP(TRUE) OP(FALSE) \
+        OP(LT) OP(GT) OP(EQ) OP(AND) OP(OR) \
+        OP(SWAP) \
+        OP(CALL) \
+        OP(DUP) \
+        OP(ARR) OP(GET_INDEX) OP(SET_INDEX) OP(DELETE) OP(LEN) OP(ITER) \
+        OP(GUARD) OP(SLIDE) OP(GET_REG) OP(SET_REG)
+
+enum {
+#define OP(name) OP_ ## name,
+    OPS(OP)
+#undef OP
+    NOPS,
+};
+
+#define OBJS(O) O(NONE) O(STR) O(TAB) O(FUNC) O(SLICE) O(ARR) O(BUF) O(NATIVE)
+
+enum {
+#define O(name) OBJ_ ## name,
+    OBJS(O)
+#undef O
+};
+
+typedef struct Prof Prof;
 
-typedef struct  {
+typedef struct Obj Obj;
+struct Obj {
     char type;
-} Obj;
+    Obj *next;
+};
 
 typedef struct {
     Obj hdr;
-    char *str;
     int len;
     unsigned hash;
+    char str[];
 } ObjString;
 
+// view into a range of parent's chars, copied only when a real
+// ObjString is needed (e.g. to be stored as a table key)
 typedef struct {
     Obj hdr;
-    ValTab *fields;
-} ObjTab;
+    ObjString *parent;
+    int off;
+    int len;
+    unsigned hash;
+    char hashed;
+    ObjString *copy;
+} ObjSlice;
 
 typedef struct {
     char type;
@@ -35,41 +86,192 @@ typedef struct {
     } as;
 } Value;
 
+// keys are strings or numbers, V_NONE marks an empty slot and V_DEAD
+// one whose key was deleted
+typedef struct {
+    Value key;
+    Value value;
+} Slot;
+
+// whole number keys from 0 up are kept in arr while it's more than half
+// full, everything else is hashed into slots. Mapped parts belong to an
+// image, growing copies them instead of reallocating. nused and ndead
+// count the keys and tombstones in slots, narrused the keys in arr
+typedef struct {
+    Slot *slots;
+    int nslots;
+    int nused;
+    int ndead;
+    Value *arr;
+    int narr;
+    int narrused;
+    char mapped;
+} ValTab;
+
+// fields missing from a table are looked up along its prototypes, a
+// chain at most MAXPROTO long. isproto marks tables some other table
+// delegates to
+#define MAXPROTO 32
+
+typedef struct ObjTab {
+    Obj hdr;
+    ValTab *fields;
+    struct ObjTab *proto;
+    char isproto;
+} ObjTab;
+
+// items are contiguous and grow by doubling, mapped items belong to an
+// image and are copied on growth like mapped table slots
+typedef struct {
+    Obj hdr;
+    Value *items;
+    int len;
+    int cap;
+    char mapped;
+} ObjArr;
+
+// packed doubles for the bulk builtins, the length is fixed
+typedef struct {
+    Obj hdr;
+    int len;
+    double data[];
+} ObjBuf;
+
+// the longest buffer whose size still fits the int allocators take
+#define MAXBUF ((INT_MAX - (int)sizeof(ObjBuf)) / (int)sizeof(double))
+
 typedef struct {
     char op;
     int arg;
 } Ins;
 
+// not written after compiling, so vms on different threads can run the
+// same chunk at the same time. Each call gets nregs registers of its own
+// for the fields of tables the optimizer took apart.
+#define MAXREGS 256
+
 typedef struct {
     Ins *ins;
     int nins;
     Value *cons;
     int ncons;
+    int nregs;
+    int id;
+    char *name;
 } Chunk;
 
+// lazy holds the parameters and body of a function that hasn't been
+// called yet, its chunk stays empty until the first call compiles it
 typedef struct {
     Obj hdr;
     Chunk *chunk;
     int arity;
+    char *lazy;
 } ObjFunc;
 
+typedef struct Vm Vm;
+
+// args points at the arguments on the vm's stack, they're replaced by
+// the result when fn returns
+typedef Value (*NativeFn)(Vm *vm, Value *args);
+
+// a C function scripts call like any other, natives belong to the
+// registry and are never freed
 typedef struct {
+    Obj hdr;
+    char *name;
+    int arity;
+    NativeFn fn;
+} ObjNative;
+
+// call chain kept for the sampling profiler, calls deeper than
+// MAXFRAMES all share the last slot. The vm writes frames through
+// volatile stores and only then counts them in nframes, so the signal
+// handler never sees a frame that isn't filled in
+#define MAXFRAMES 256
+
+typedef struct {
+    Chunk *chunk;
+    int ip;
+} Frame;
+
+// where GET_FIELD last found an inherited field, by instruction. An
+// entry holds while the receiver's prototype is the same and nothing
+// was stored into a prototype since, storing moves the vm's epoch on
+#define NFIELDCACHE 256
+
+typedef struct {
+    ObjTab *proto;
+    ObjTab *holder;
+    int slot;
+    uint64_t epoch;
+} FieldCache;
+
+// objects created while running are linked into objs and owned by the
+// vm, constants are owned by their chunk. The first nbase stack slots
+// were restored from a snapshot and every run starts on top of them.
+struct Vm {
     Value *stack;
     int nstack;
-} Vm;
+    int nbase;
+    Obj *objs;
+    char err[256];
+    Prof *prof;
+    Frame frames[MAXFRAMES + 1];
+    volatile sig_atomic_t nframes;
+    int sampling;
+    uint64_t epoch;
+    FieldCache fcache[NFIELDCACHE];
+};
 
 #define OBJVAL(o) ((Value){.type = V_OBJ, {.obj = (Obj*)(o)}})
 
+enum { STAR_OK, STAR_ERR };
+
 Chunk *newchunk();
+int newchunkid();
 void freechunk(Chunk *c);
-Vm *newvm();
-void freevm(Vm *vm);
+STAR_API Vm *newvm();
+STAR_API void freevm(Vm *vm);
+STAR_API void resetvm(Vm *vm);
 ObjFunc *newfunc();
+STAR_API void freefunc(ObjFunc *fn);
+
+// a table literal's keys with nil values, NEW n starts from a copy of
+// the template in constant n - 1 so the literal only fills in values.
+// Templates are constants of one chunk and own their key strings
+ObjTab *newtemplate();
+void addtemplatekey(ObjTab *t, char *name);
+ObjTab *copytemplate(ObjTab *t);
+void freetemplate(ObjTab *t);
 
-Value numval(double num);
-Value boolval(char boolean);
-Value nilval();
-Value strval(char *str);
+// nil for p clears it, errors if the chain would loop or get too long
+void setproto(Vm *vm, ObjTab *t, ObjTab *p);
+void setname(Chunk *c, char *name);
+
+// top-level locals that outlive a script: a script compiled in a scope
+// starts with its names declared as the bottom stack slots, with keep
+// set its own top-level locals stay on the stack and join the scope
+typedef struct {
+    char **names;
+    int nnames;
+} Scope;
+
+STAR_API Scope *newscope();
+STAR_API void freescope(Scope *s);
+void scopeadd(Scope *s, char *name);
+
+STAR_API Value numval(double num);
+STAR_API Value boolval(char boolean);
+STAR_API Value nilval();
+STAR_API Value strval(char *str);
+Value sliceval(Value str, int off, int len);
+Value arrval(int cap);
+void arrpush(ObjArr *arr, Value v);
+Value bufval(int len);
+STAR_API Value startrack(Vm *vm, Value v);
+STAR_API const char *typname(Value v);
+ObjString *strobj(Value v);
 int addcons(Chunk *c, Value v);
 int emit(Chunk *c, Ins i);
 
@@ -94,7 +296,7 @@ int emitlt(Chunk *c);
 int emitgt(Chunk *c);
 int emiteq(Chunk *c);
 int emitnil(Chunk *c);
-int emitnew(Chunk *c);
+int emitnew(Chunk *c, int tmpl);
 int emitdup(Chunk *c);
 int emittrue(Chunk *c);
 int emitfalse(Chunk *c);
@@ -102,20 +304,60 @@ int emitand(Chunk *c);
 int emitor(Chunk *c);
 int emitswap(Chunk *c);
 int emitcall(Chunk *c, int nargs);
+int emitarr(Chunk *c, int n);
+int emitgetindex(Chunk *c);
+int emitsetindex(Chunk *c);
+int emitdelete(Chunk *c);
+int emitlen(Chunk *c);
+int emititer(Chunk *c);
+int emitguard(Chunk *c, int consid);
+int emitslide(Chunk *c, int n);
 
 void patchjmp(Chunk *c, int ip);
 int getip(Chunk *c);
 void fixassign(Chunk *c, int ip);
+void fixdelete(Chunk *c, int ip);
 
 ValTab *newvaltab();
+ValTab *copyvaltab(ValTab *vt);
 void freevaltab(ValTab *vt);
 int valtabget(ValTab *vt, ObjString *key, Value *dst);
+int valtabfind(ValTab *vt, char *key, int len, unsigned hash);
+int valtabgetn(ValTab *vt, char *key, int len, unsigned hash, Value *dst);
+int valtabgetnum(ValTab *vt, double key, Value *dst);
 void valtabset(ValTab *vt, ObjString *key, Value v);
-int valtabnext(ValTab *vt, int idx, ObjString **key, Value *dst);
+void valtabsetnum(ValTab *vt, double key, Value v);
+void valtabdel(ValTab *vt, ObjString *key);
+void valtabdelnum(ValTab *vt, double key);
+int valtabnext(ValTab *vt, int idx, Value *key, Value *dst);
+int valtabcount(ValTab *vt);
+
+// scripts reach a registered native by its name unless a local hides
+// it, defining a name again replaces its function. The builtins
+// (src/builtin.c) are registered before the first lookup.
+STAR_API void defnative(char *name, int arity, NativeFn fn);
+ObjNative *findnative(char *name);
 
+const char *opname(int op);
 void printchunk(Chunk *c);
 void printstack(Vm *vm);
 
 void runchunk(Vm *vm, Chunk *c);
 
 ObjFunc *compile(char *src);
+ObjFunc *compilein(char *src, Scope *scope, int keep);
+ObjFunc *compilen(char *src, size_t len, Scope *scope, int keep);
+ObjFunc *compilefp(FILE *fp, Scope *scope, int keep);
+void compilelazy(ObjFunc *fn);
+ObjFunc *compilecopy(ObjFunc *fn);
+
+// library entry points, errors are returned instead of exiting
+STAR_API int starcompile(Vm *vm, char *src, ObjFunc **fn);
+STAR_API int starcompilein(Vm *vm, char *src, Scope *scope, int keep, ObjFunc **fn);
+STAR_API int starcompilen(Vm *vm, char *src, size_t len, Scope *scope, int keep,
+        ObjFunc **fn);
+STAR_API int starcompilefp(Vm *vm, FILE *fp, Scope *scope, int keep, ObjFunc **fn);
+STAR_API int starrun(Vm *vm, ObjFunc *fn);
+STAR_API Value starresult(Vm *vm);
+STAR_API char *starerror(Vm *vm);
+int tokenize(char *src);
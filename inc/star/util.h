@@ -1,5 +1,7 @@
 #pragma once
 
+#include <setjmp.h>
+
 void *newarray(int elemsz);
 void *arraygrow(void *array, int size);
 void freearray(void *array);
@@ -15,3 +17,17 @@ void *tabgetp(Tab *t, char *key);
 void tabsetp(Tab *t, char *key, void *ptr);
 
 unsigned strhash(char *str);
+unsigned strhashn(char *str, int len);
+
+// starfail() jumps to the innermost handler pushed on this thread, without
+// one it prints the message and exits
+typedef struct ErrJmp ErrJmp;
+struct ErrJmp {
+    jmp_buf jb;
+    char msg[256];
+    ErrJmp *prev;
+};
+
+void pusherr(ErrJmp *ej);
+void poperr(ErrJmp *ej);
+void starfail(char *fmt, ...) __attribute__((noreturn));
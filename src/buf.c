@@ -0,0 +1,191 @@
+#include <math.h>
+#include <star/buf.h>
+
+// the loops handle a vector of doubles at a time and finish the last
+// few one by one, sums keep two vectors of partial sums going so the
+// adds don't wait on each other
+#if defined(__AVX__)
+#include <immintrin.h>
+#define W 4
+typedef __m256d V;
+#define load _mm256_loadu_pd
+#define store _mm256_storeu_pd
+#define set1 _mm256_set1_pd
+#define add _mm256_add_pd
+#define mul _mm256_mul_pd
+#define min _mm256_min_pd
+#define max _mm256_max_pd
+#define and _mm256_and_pd
+#define or _mm256_or_pd
+#define anyset _mm256_movemask_pd
+#define nans(a) _mm256_cmp_pd(a, a, _CMP_UNORD_Q)
+#define lt(a, b) _mm256_cmp_pd(a, b, _CMP_LT_OQ)
+#define gt(a, b) _mm256_cmp_pd(a, b, _CMP_GT_OQ)
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define W 2
+typedef __m128d V;
+#define load _mm_loadu_pd
+#define store _mm_storeu_pd
+#define set1 _mm_set1_pd
+#define add _mm_add_pd
+#define mul _mm_mul_pd
+#define min _mm_min_pd
+#define max _mm_max_pd
+#define and _mm_and_pd
+#define or _mm_or_pd
+#define anyset _mm_movemask_pd
+#define nans(a) _mm_cmpunord_pd(a, a)
+#define lt _mm_cmplt_pd
+#define gt _mm_cmpgt_pd
+#endif
+
+#ifdef W
+static double hsum(V v) {
+    double d[W];
+    store(d, v);
+    double s = 0;
+    for (int i = 0; i < W; i++) s += d[i];
+    return s;
+}
+
+static double hreduce(V v, int ismax) {
+    double d[W];
+    store(d, v);
+    double r = d[0];
+    for (int i = 1; i < W; i++)
+        if (ismax ? d[i] > r : d[i] < r) r = d[i];
+    return r;
+}
+
+// dst[i] = f(a[i], b[i]) with b a buffer, or with k in every lane
+#define MAP(dst, a, b, n, f) \
+    for (; i + W <= n; i += W) store(dst + i, f(load(a + i), load(b + i)));
+#define MAPK(dst, a, k, n, f) \
+    for (V vk = set1(k); i + W <= n; i += W) store(dst + i, f(load(a + i), vk));
+#define LTMASK(a, b) and(lt(a, b), set1(1))
+#define GTMASK(a, b) and(gt(a, b), set1(1))
+#else
+#define MAP(dst, a, b, n, f)
+#define MAPK(dst, a, k, n, f)
+#endif
+
+double bufsum(double *a, int n) {
+    int i = 0;
+    double s = 0;
+#ifdef W
+    V s0 = set1(0), s1 = set1(0);
+    for (; i + 2 * W <= n; i += 2 * W) {
+        s0 = add(s0, load(a + i));
+        s1 = add(s1, load(a + i + W));
+    }
+    s = hsum(add(s0, s1));
+#endif
+    for (; i < n; i++) s += a[i];
+    return s;
+}
+
+double bufdot(double *a, double *b, int n) {
+    int i = 0;
+    double s = 0;
+#ifdef W
+    V s0 = set1(0), s1 = set1(0);
+    for (; i + 2 * W <= n; i += 2 * W) {
+        s0 = add(s0, mul(load(a + i), load(b + i)));
+        s1 = add(s1, mul(load(a + i + W), load(b + i + W)));
+    }
+    s = hsum(add(s0, s1));
+#endif
+    for (; i < n; i++) s += a[i] * b[i];
+    return s;
+}
+
+// n has to be at least 1. min and max drop a NaN in either operand
+// depending on its position, so NaNs are tracked on the side
+double bufmin(double *a, int n) {
+    int i = 0;
+    double r = a[0];
+#ifdef W
+    V m = set1(r), nan = set1(0);
+    for (; i + W <= n; i += W) {
+        V x = load(a + i);
+        m = min(m, x);
+        nan = or(nan, nans(x));
+    }
+    if (anyset(nan)) return NAN;
+    r = hreduce(m, 0);
+#endif
+    for (; i < n; i++) {
+        if (a[i] != a[i]) return NAN;
+        if (a[i] < r) r = a[i];
+    }
+    return r;
+}
+
+double bufmax(double *a, int n) {
+    int i = 0;
+    double r = a[0];
+#ifdef W
+    V m = set1(r), nan = set1(0);
+    for (; i + W <= n; i += W) {
+        V x = load(a + i);
+        m = max(m, x);
+        nan = or(nan, nans(x));
+    }
+    if (anyset(nan)) return NAN;
+    r = hreduce(m, 1);
+#endif
+    for (; i < n; i++) {
+        if (a[i] != a[i]) return NAN;
+        if (a[i] > r) r = a[i];
+    }
+    return r;
+}
+
+void bufadd(double *dst, double *a, double *b, int n) {
+    int i = 0;
+    MAP(dst, a, b, n, add);
+    for (; i < n; i++) dst[i] = a[i] + b[i];
+}
+
+void bufaddk(double *dst, double *a, double k, int n) {
+    int i = 0;
+    MAPK(dst, a, k, n, add);
+    for (; i < n; i++) dst[i] = a[i] + k;
+}
+
+void bufmul(double *dst, double *a, double *b, int n) {
+    int i = 0;
+    MAP(dst, a, b, n, mul);
+    for (; i < n; i++) dst[i] = a[i] * b[i];
+}
+
+void bufscale(double *dst, double *a, double k, int n) {
+    int i = 0;
+    MAPK(dst, a, k, n, mul);
+    for (; i < n; i++) dst[i] = a[i] * k;
+}
+
+void buflt(double *dst, double *a, double *b, int n) {
+    int i = 0;
+    MAP(dst, a, b, n, LTMASK);
+    for (; i < n; i++) dst[i] = a[i] < b[i];
+}
+
+void bufltk(double *dst, double *a, double k, int n) {
+    int i = 0;
+    MAPK(dst, a, k, n, LTMASK);
+    for (; i < n; i++) dst[i] = a[i] < k;
+}
+
+void bufgt(double *dst, double *a, double *b, int n) {
+    int i = 0;
+    MAP(dst, a, b, n, GTMASK);
+    for (; i < n; i++) dst[i] = a[i] > b[i];
+}
+
+void bufgtk(double *dst, double *a, double k, int n) {
+    int i = 0;
+    MAPK(dst, a, k, n, GTMASK);
+    for (; i < n; i++) dst[i] = a[i] > k;
+}
@@ -0,0 +1,207 @@
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include <star/util.h>
+#include <star/buf.h>
+#include <star/builtin.h>
+
+static ObjBuf *checkbuf(Value v, char *fn) {
+    if (v.type != V_OBJ || v.as.obj->type != OBJ_BUF)
+        starfail("%s expects a BUF, got %s", fn, typname(v));
+    return (ObjBuf *)v.as.obj;
+}
+
+// the second operand of the elementwise ones is a number or a buffer as
+// long as the first
+static ObjBuf *checkother(ObjBuf *a, Value v, char *fn) {
+    if (v.type == V_NUM) return 0;
+    ObjBuf *b = checkbuf(v, fn);
+    if (b->len != a->len)
+        starfail("%s of buffers of length %i and %i", fn, a->len, b->len);
+    return b;
+}
+
+static ObjBuf *newbuf(Vm *vm, int len) {
+    return (ObjBuf *)startrack(vm, bufval(len)).as.obj;
+}
+
+// buf(n) is n zeros, buf(array) packs an array of numbers
+static Value buf(Vm *vm, Value *args) {
+    Value v = args[0];
+    if (v.type == V_NUM) {
+        if (!(v.as.num >= 0 && v.as.num <= MAXBUF) || v.as.num != (int)v.as.num)
+            starfail("bad buffer length %g", v.as.num);
+        return OBJVAL(newbuf(vm, v.as.num));
+    }
+    if (v.type == V_OBJ && v.as.obj->type == OBJ_BUF) {
+        ObjBuf *src = (ObjBuf *)v.as.obj;
+        ObjBuf *dst = newbuf(vm, src->len);
+        memcpy(dst->data, src->data, src->len * sizeof(double));
+        return OBJVAL(dst);
+    }
+    if (v.type != V_OBJ || v.as.obj->type != OBJ_ARR)
+        starfail("buf expects a length or an array, got %s", typname(v));
+    ObjArr *arr = (ObjArr *)v.as.obj;
+    ObjBuf *dst = newbuf(vm, arr->len);
+    for (int i = 0; i < arr->len; i++) {
+        if (arr->items[i].type != V_NUM)
+            starfail("buffers hold numbers, got %s", typname(arr->items[i]));
+        dst->data[i] = arr->items[i].as.num;
+    }
+    return OBJVAL(dst);
+}
+
+static Value sum(Vm *vm, Value *args) {
+    ObjBuf *a = checkbuf(args[0], "sum");
+    return numval(bufsum(a->data, a->len));
+}
+
+// nil for an empty buffer
+static Value min(Vm *vm, Value *args) {
+    ObjBuf *a = checkbuf(args[0], "min");
+    return a->len ? numval(bufmin(a->data, a->len)) : nilval();
+}
+
+static Value max(Vm *vm, Value *args) {
+    ObjBuf *a = checkbuf(args[0], "max");
+    return a->len ? numval(bufmax(a->data, a->len)) : nilval();
+}
+
+static Value dot(Vm *vm, Value *args) {
+    ObjBuf *a = checkbuf(args[0], "dot");
+    ObjBuf *b = checkbuf(args[1], "dot");
+    if (b->len != a->len)
+        starfail("dot of buffers of length %i and %i", a->len, b->len);
+    return numval(bufdot(a->data, b->data, a->len));
+}
+
+static Value scale(Vm *vm, Value *args) {
+    ObjBuf *a = checkbuf(args[0], "scale");
+    if (args[1].type != V_NUM)
+        starfail("scale expects a number, got %s", typname(args[1]));
+    ObjBuf *dst = newbuf(vm, a->len);
+    bufscale(dst->data, a->data, args[1].as.num, a->len);
+    return OBJVAL(dst);
+}
+
+#define ELEMWISE(name, bufop, kop) \
+    static Value name(Vm *vm, Value *args) { \
+        ObjBuf *a = checkbuf(args[0], #name); \
+        ObjBuf *b = checkother(a, args[1], #name); \
+        ObjBuf *dst = newbuf(vm, a->len); \
+        if (b) bufop(dst->data, a->data, b->data, a->len); \
+        else kop(dst->data, a->data, args[1].as.num, a->len); \
+        return OBJVAL(dst); \
+    }
+
+ELEMWISE(add, bufadd, bufaddk)
+ELEMWISE(mul, bufmul, bufscale)
+ELEMWISE(lt, buflt, bufltk)
+ELEMWISE(gt, bufgt, bufgtk)
+
+static double checknum(Value v, char *fn) {
+    if (v.type != V_NUM)
+        starfail("%s expects a number, got %s", fn, typname(v));
+    return v.as.num;
+}
+
+// seconds from an arbitrary point, for timing
+static Value clock_(Vm *vm, Value *args) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return numval(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+#define MATH1(name, f) \
+    static Value name(Vm *vm, Value *args) { \
+        return numval(f(checknum(args[0], #f))); \
+    }
+
+MATH1(sqrt_, sqrt)
+MATH1(floor_, floor)
+MATH1(ceil_, ceil)
+MATH1(abs_, fabs)
+MATH1(sin_, sin)
+MATH1(cos_, cos)
+MATH1(exp_, exp)
+MATH1(log_, log)
+
+static Value pow_(Vm *vm, Value *args) {
+    return numval(pow(checknum(args[0], "pow"), checknum(args[1], "pow")));
+}
+
+static int checkstr(Value v, char *fn) {
+    if (v.type == V_OBJ && v.as.obj->type == OBJ_STR)
+        return ((ObjString *)v.as.obj)->len;
+    if (v.type == V_OBJ && v.as.obj->type == OBJ_SLICE)
+        return ((ObjSlice *)v.as.obj)->len;
+    starfail("%s expects a string, got %s", fn, typname(v));
+}
+
+static Value len(Vm *vm, Value *args) {
+    return numval(checkstr(args[0], "len"));
+}
+
+// a slice of n chars from off, nothing is copied
+static Value substr(Vm *vm, Value *args) {
+    int len = checkstr(args[0], "substr");
+    double off = checknum(args[1], "substr");
+    double n = checknum(args[2], "substr");
+    if (!(off >= 0 && off <= len) || !(n >= 0 && n <= len))
+        starfail("substr of %g from %g out of range", n, off);
+    if (off != (int)off || n != (int)n)
+        starfail("substr expects whole numbers, got %g and %g", off, n);
+    return startrack(vm, sliceval(args[0], off, n));
+}
+
+static ObjTab *checktab(Value v, char *fn) {
+    if (v.type != V_OBJ || v.as.obj->type != OBJ_TAB)
+        starfail("%s expects a TAB, got %s", fn, typname(v));
+    return (ObjTab *)v.as.obj;
+}
+
+// fields t doesn't have are looked up in p, returns t
+static Value setproto_(Vm *vm, Value *args) {
+    ObjTab *t = checktab(args[0], "setproto");
+    ObjTab *p = args[1].type == V_NIL ? 0 : checktab(args[1], "setproto");
+    setproto(vm, t, p);
+    return args[0];
+}
+
+static Value proto(Vm *vm, Value *args) {
+    ObjTab *t = checktab(args[0], "proto");
+    return t->proto ? OBJVAL(t->proto) : nilval();
+}
+
+// own fields only
+static Value size(Vm *vm, Value *args) {
+    return numval(valtabcount(checktab(args[0], "size")->fields));
+}
+
+void defbuiltins(void (*def)(char *name, int arity, NativeFn fn)) {
+    def("clock", 0, clock_);
+    def("sqrt", 1, sqrt_);
+    def("floor", 1, floor_);
+    def("ceil", 1, ceil_);
+    def("abs", 1, abs_);
+    def("sin", 1, sin_);
+    def("cos", 1, cos_);
+    def("exp", 1, exp_);
+    def("log", 1, log_);
+    def("pow", 2, pow_);
+    def("len", 1, len);
+    def("substr", 3, substr);
+    def("size", 1, size);
+    def("setproto", 2, setproto_);
+    def("proto", 1, proto);
+    def("buf", 1, buf);
+    def("sum", 1, sum);
+    def("min", 1, min);
+    def("max", 1, max);
+    def("dot", 2, dot);
+    def("add", 2, add);
+    def("mul", 2, mul);
+    def("scale", 2, scale);
+    def("lt", 2, lt);
+    def("gt", 2, gt);
+}
@@ -0,0 +1,229 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <star/mem.h>
+#include <star/util.h>
+#include <star/cache.h>
+
+// entries are chained twice, by source hash for lookups and by function
+// for releases, and kept on a list from most to least recently used
+typedef struct Entry Entry;
+struct Entry {
+    uint64_t hash;
+    char *src;
+    int len;
+    ObjFunc *fn;
+    int size;
+    int refs;
+    Entry *next;
+    Entry *fnext;
+    Entry *newer;
+    Entry *older;
+};
+
+struct Cache {
+    Entry **bysrc;
+    Entry **byfn;
+    int nbuckets;
+    Entry *newest;
+    Entry *oldest;
+    CacheStats stats;
+    pthread_mutex_t lock;
+};
+
+static uint64_t srchash(char *src, int len) {
+    uint64_t hash = 14695981039346656037ull;
+    for (int i = 0; i < len; i++) {
+        hash ^= (unsigned char)src[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static unsigned fnhash(ObjFunc *fn) {
+    return (unsigned)((uintptr_t)fn >> 4);
+}
+
+static Entry **allocbuckets(int n) {
+    Entry **b = xmalloc(n * sizeof(Entry *));
+    memset(b, 0, n * sizeof(Entry *));
+    return b;
+}
+
+Cache *newcache(int maxbytes) {
+    Cache *c = xmalloc(sizeof(Cache));
+    memset(c, 0, sizeof(Cache));
+    c->nbuckets = 64;
+    c->bysrc = allocbuckets(c->nbuckets);
+    c->byfn = allocbuckets(c->nbuckets);
+    c->stats.maxbytes = maxbytes;
+    pthread_mutex_init(&c->lock, 0);
+    return c;
+}
+
+static void freeentry(Entry *e) {
+    freefunc(e->fn);
+    xfree(e->src);
+    xfree(e);
+}
+
+// functions still acquired are freed anyway, release them first
+void freecache(Cache *c) {
+    Entry *next;
+    for (Entry *e = c->newest; e; e = next) {
+        next = e->older;
+        freeentry(e);
+    }
+    xfree(c->bysrc);
+    xfree(c->byfn);
+    pthread_mutex_destroy(&c->lock);
+    xfree(c);
+}
+
+static void detach(Cache *c, Entry *e) {
+    if (e->newer) e->newer->older = e->older;
+    else c->newest = e->older;
+    if (e->older) e->older->newer = e->newer;
+    else c->oldest = e->newer;
+    e->newer = e->older = 0;
+}
+
+static void pushnewest(Cache *c, Entry *e) {
+    e->older = c->newest;
+    e->newer = 0;
+    if (c->newest) c->newest->newer = e;
+    else c->oldest = e;
+    c->newest = e;
+}
+
+static void insert(Cache *c, Entry *e) {
+    Entry **b = &c->bysrc[e->hash % c->nbuckets];
+    e->next = *b;
+    *b = e;
+    b = &c->byfn[fnhash(e->fn) % c->nbuckets];
+    e->fnext = *b;
+    *b = e;
+}
+
+static void rehash(Cache *c) {
+    xfree(c->bysrc);
+    xfree(c->byfn);
+    c->nbuckets *= 2;
+    c->bysrc = allocbuckets(c->nbuckets);
+    c->byfn = allocbuckets(c->nbuckets);
+    for (Entry *e = c->newest; e; e = e->older)
+        insert(c, e);
+}
+
+static void removeentry(Cache *c, Entry *e) {
+    Entry **b = &c->bysrc[e->hash % c->nbuckets];
+    while (*b != e) b = &(*b)->next;
+    *b = e->next;
+    b = &c->byfn[fnhash(e->fn) % c->nbuckets];
+    while (*b != e) b = &(*b)->fnext;
+    *b = e->fnext;
+    detach(c, e);
+    c->stats.entries--;
+    c->stats.bytes -= e->size;
+}
+
+static Entry *find(Cache *c, uint64_t hash, char *src, int len) {
+    for (Entry *e = c->bysrc[hash % c->nbuckets]; e; e = e->next)
+        if (e->hash == hash && e->len == len && memcmp(e->src, src, len) == 0)
+            return e;
+    return 0;
+}
+
+// entries in use are skipped, the cache can go over the cap while
+// everything old is still acquired
+static void evict(Cache *c) {
+    Entry *older;
+    for (Entry *e = c->oldest; e && c->stats.bytes > c->stats.maxbytes; e = older) {
+        older = e->newer;
+        if (e->refs) continue;
+        removeentry(c, e);
+        freeentry(e);
+        c->stats.evictions++;
+    }
+}
+
+static ObjFunc *acquire(Cache *c, Entry *e) {
+    e->refs++;
+    detach(c, e);
+    pushnewest(c, e);
+    return e->fn;
+}
+
+// like starcompile, the function has to be given back with cacherelease
+int cachecompile(Cache *c, Vm *vm, char *src, ObjFunc **fn) {
+    int len = strlen(src);
+    uint64_t hash = srchash(src, len);
+    pthread_mutex_lock(&c->lock);
+    Entry *e = find(c, hash, src, len);
+    if (e) {
+        c->stats.hits++;
+        *fn = acquire(c, e);
+        pthread_mutex_unlock(&c->lock);
+        return STAR_OK;
+    }
+    c->stats.misses++;
+    pthread_mutex_unlock(&c->lock);
+    // compiled without the lock so hits don't wait on it
+    int before = memused();
+    if (starcompile(vm, src, fn) != STAR_OK)
+        return STAR_ERR;
+    int size = memused() - before;
+    pthread_mutex_lock(&c->lock);
+    if ((e = find(c, hash, src, len))) {
+        // another thread compiled it first
+        freefunc(*fn);
+        *fn = acquire(c, e);
+        pthread_mutex_unlock(&c->lock);
+        return STAR_OK;
+    }
+    e = xmalloc(sizeof(Entry));
+    memset(e, 0, sizeof(Entry));
+    e->hash = hash;
+    e->len = len;
+    e->src = xmalloc(len + 1);
+    memcpy(e->src, src, len + 1);
+    e->fn = *fn;
+    e->size = size + len + 1 + sizeof(Entry);
+    if (c->stats.entries == c->nbuckets) rehash(c);
+    e->refs = 1;
+    insert(c, e);
+    pushnewest(c, e);
+    c->stats.entries++;
+    c->stats.bytes += e->size;
+    evict(c);
+    pthread_mutex_unlock(&c->lock);
+    return STAR_OK;
+}
+
+void cacherelease(Cache *c, ObjFunc *fn) {
+    pthread_mutex_lock(&c->lock);
+    Entry *e = c->byfn[fnhash(fn) % c->nbuckets];
+    while (e && e->fn != fn) e = e->fnext;
+    if (!e) {
+        pthread_mutex_unlock(&c->lock);
+        starfail("function not from this cache");
+    }
+    e->refs--;
+    evict(c);
+    pthread_mutex_unlock(&c->lock);
+}
+
+CacheStats cachestats(Cache *c) {
+    pthread_mutex_lock(&c->lock);
+    CacheStats s = c->stats;
+    pthread_mutex_unlock(&c->lock);
+    return s;
+}
+
+void printcache(Cache *c) {
+    CacheStats s = cachestats(c);
+    printf("cache: %llu hits, %llu misses, %llu evicted, %i entries, "
+            "%i/%i bytes\n", (unsigned long long)s.hits,
+            (unsigned long long)s.misses, (unsigned long long)s.evictions,
+            s.entries, s.bytes, s.maxbytes);
+}
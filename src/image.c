@@ -0,0 +1,949 @@
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <star/mem.h>
+#include <star/util.h>
+#include <star/image.h>
+
+// header, then what's used as is (instructions, strings, names), then
+// everything holding pointers: functions, chunks, constant pools, tables,
+// arrays, natives and a snapshot's stack. Pointers are written as if the image was
+// mapped at base and listed in relocs. A mapping anywhere else adds the
+// difference to each, so only the pages of the pointer part get copied,
+// and one that lands on base needs no fix-ups at all. The lists at the
+// end are only read.
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t abi;
+    uint32_t ops;
+    uint32_t size;
+    uint32_t checksum;
+    uint32_t root;
+    uint32_t stack;
+    uint32_t nstack;
+    uint32_t names;
+    uint32_t relocs;
+    uint32_t nrelocs;
+    uint32_t chunks;
+    uint32_t nchunks;
+    uint32_t tabs;
+    uint32_t ntabs;
+    uint32_t arrs;
+    uint32_t narrs;
+    uint32_t natives;
+    uint32_t nnatives;
+    uint64_t base;
+} Header;
+
+static const char MAGIC[4] = {0x7f, 'S', 'T', 'R'};
+
+#define ALIGN 8
+
+struct Image {
+    char *base;
+    uint32_t size;
+    int fd;
+};
+
+typedef struct {
+    char *buf;
+    uint32_t len;
+    uint32_t cap;
+} Buf;
+
+// a pointer field in the pointer part and the offset it points to, in
+// either part
+typedef struct {
+    uint32_t field;
+    uint32_t target;
+    char text;
+} Reloc;
+
+typedef struct {
+    Obj *obj;
+    uint32_t off;
+} Seen;
+
+// objects can be reached more than once and tables can contain
+// themselves, each is written once and remembered in seen
+typedef struct {
+    Buf text;
+    Buf fix;
+    Reloc *relocs;
+    int nrelocs;
+    uint32_t *chunks;
+    int nchunks;
+    uint32_t *tabs;
+    int ntabs;
+    uint32_t *arrs;
+    int narrs;
+    uint32_t *natives;
+    int nnatives;
+    Seen *seen;
+    int nseen;
+    int seencap;
+} Writer;
+
+#define FIX(w, off, type) ((type *)((w)->fix.buf + (off)))
+
+static uint32_t align(uint32_t n) {
+    return (n + ALIGN - 1) & ~(ALIGN - 1);
+}
+
+// images are only read by the same kind of build that wrote them
+static uint32_t abi() {
+    return sizeof(void *) | sizeof(Value) << 8 | sizeof(Ins) << 16
+        | sizeof(Chunk) << 24;
+}
+
+// opcodes and object types are stored by number
+static uint32_t opshash() {
+    unsigned hash = 5381;
+    for (int op = 0; op < NOPS; op++)
+        hash = hash * 33 + strhash((char *)opname(op));
+    return hash * 33 + (V_OBJ << 24 | OBJ_STR << 20 | OBJ_TAB << 16
+            | OBJ_FUNC << 12 | OBJ_ARR << 8 | OBJ_BUF << 4 | OBJ_NATIVE);
+}
+
+static uint32_t checksum(char *data, uint32_t size) {
+    uint32_t hash = 2166136261u;
+    for (uint32_t i = 0; i + 4 <= size; i += 4) {
+        uint32_t w;
+        memcpy(&w, data + i, 4);
+        hash = (hash ^ w) * 16777619u;
+    }
+    return hash;
+}
+
+// spread over 4GB slots so different images rarely want the same place
+static uint64_t prefbase(Buf *text) {
+    if (sizeof(void *) < 8) return 0;
+    uint32_t hash = text->len ? checksum(text->buf, text->len) : 0;
+    return 0x100000000000ull + ((uint64_t)(hash & 0xfff) << 32);
+}
+
+static uint32_t reserve(Buf *b, uint32_t size) {
+    uint32_t off = b->len;
+    uint32_t len = off + align(size);
+    if (len > b->cap) {
+        uint32_t cap = b->cap ? b->cap : 256;
+        while (cap < len) cap *= 2;
+        b->buf = b->buf ? xrealloc(b->buf, cap) : xmalloc(cap);
+        b->cap = cap;
+    }
+    memset(b->buf + off, 0, len - off);
+    b->len = len;
+    return off;
+}
+
+static void addreloc(Writer *w, uint32_t field, uint32_t target, int text) {
+    int idx = w->nrelocs++;
+    w->relocs = arraygrow(w->relocs, w->nrelocs);
+    w->relocs[idx] = (Reloc){field, target, text};
+}
+
+static uint32_t *addoff(uint32_t *list, int *n, uint32_t off) {
+    int idx = (*n)++;
+    list = arraygrow(list, *n);
+    list[idx] = off;
+    return list;
+}
+
+static Seen *findseen(Writer *w, Obj *o) {
+    uintptr_t hash = (uintptr_t)o >> 4;
+    for (int i = 0;; i++) {
+        Seen *s = &w->seen[(hash + i) & (w->seencap - 1)];
+        if (!s->obj || s->obj == o) return s;
+    }
+}
+
+static void remember(Writer *w, Obj *o, uint32_t off) {
+    if ((w->nseen + 1) * 2 > w->seencap) {
+        Seen *old = w->seen;
+        int n = w->seencap;
+        w->seencap *= 2;
+        w->seen = xmalloc(w->seencap * sizeof(Seen));
+        memset(w->seen, 0, w->seencap * sizeof(Seen));
+        for (int i = 0; i < n; i++)
+            if (old[i].obj) *findseen(w, old[i].obj) = old[i];
+        xfree(old);
+    }
+    Seen *s = findseen(w, o);
+    s->obj = o;
+    s->off = off;
+    w->nseen++;
+}
+
+static int istext(Obj *o) {
+    return o->type == OBJ_STR || o->type == OBJ_SLICE;
+}
+
+static uint32_t writechars(Writer *w, char *str) {
+    int len = strlen(str);
+    uint32_t off = reserve(&w->text, len + 1);
+    memcpy(w->text.buf + off, str, len + 1);
+    return off;
+}
+
+static uint32_t writestr(Writer *w, ObjString *str) {
+    uint32_t off = reserve(&w->text, sizeof(ObjString) + str->len + 1);
+    ObjString *dst = (ObjString *)(w->text.buf + off);
+    dst->hdr.type = OBJ_STR;
+    dst->len = str->len;
+    dst->hash = str->hash;
+    memcpy(dst->str, str->str, str->len + 1);
+    return off;
+}
+
+static uint32_t writeobj(Writer *w, Obj *o);
+
+static void writeval(Writer *w, uint32_t field, Value v) {
+    Value *dst = FIX(w, field, Value);
+    dst->type = v.type;
+    if (v.type != V_OBJ) {
+        dst->as = v.as;
+        return;
+    }
+    uint32_t off = writeobj(w, v.as.obj);
+    addreloc(w, field + offsetof(Value, as.obj), off, istext(v.as.obj));
+}
+
+// images hold bytecode only, bodies not called yet are compiled first
+static uint32_t writefunc(Writer *w, ObjFunc *fn) {
+    if (fn->lazy) compilelazy(fn);
+    Chunk *c = fn->chunk;
+    uint32_t off = reserve(&w->fix, sizeof(ObjFunc));
+    remember(w, (Obj *)fn, off);
+    uint32_t chunk = reserve(&w->fix, sizeof(Chunk));
+    uint32_t cons = reserve(&w->fix, c->ncons * sizeof(Value));
+    uint32_t ins = reserve(&w->text, c->nins * sizeof(Ins));
+    for (int i = 0; i < c->nins; i++) {
+        Ins *dst = (Ins *)(w->text.buf + ins) + i;
+        dst->op = c->ins[i].op;
+        dst->arg = c->ins[i].arg;
+    }
+    uint32_t name = writechars(w, c->name);
+    FIX(w, off, ObjFunc)->hdr.type = OBJ_FUNC;
+    FIX(w, off, ObjFunc)->arity = fn->arity;
+    FIX(w, chunk, Chunk)->nins = c->nins;
+    FIX(w, chunk, Chunk)->ncons = c->ncons;
+    FIX(w, chunk, Chunk)->nregs = c->nregs;
+    FIX(w, chunk, Chunk)->id = -1;
+    addreloc(w, off + offsetof(ObjFunc, chunk), chunk, 0);
+    addreloc(w, chunk + offsetof(Chunk, ins), ins, 1);
+    addreloc(w, chunk + offsetof(Chunk, cons), cons, 0);
+    addreloc(w, chunk + offsetof(Chunk, name), name, 1);
+    w->chunks = addoff(w->chunks, &w->nchunks, chunk);
+    for (int i = 0; i < c->ncons; i++)
+        writeval(w, cons + i * sizeof(Value), c->cons[i]);
+    return off;
+}
+
+static uint32_t writetab(Writer *w, ObjTab *tab) {
+    ValTab *vt = tab->fields;
+    uint32_t off = reserve(&w->fix, sizeof(ObjTab));
+    remember(w, (Obj *)tab, off);
+    uint32_t fields = reserve(&w->fix, sizeof(ValTab));
+    uint32_t slots = reserve(&w->fix, vt->nslots * sizeof(Slot));
+    uint32_t arr = reserve(&w->fix, vt->narr * sizeof(Value));
+    FIX(w, off, ObjTab)->hdr.type = OBJ_TAB;
+    FIX(w, off, ObjTab)->isproto = tab->isproto;
+    FIX(w, fields, ValTab)->nslots = vt->nslots;
+    FIX(w, fields, ValTab)->nused = vt->nused;
+    FIX(w, fields, ValTab)->ndead = vt->ndead;
+    FIX(w, fields, ValTab)->narr = vt->narr;
+    FIX(w, fields, ValTab)->narrused = vt->narrused;
+    FIX(w, fields, ValTab)->mapped = 1;
+    addreloc(w, off + offsetof(ObjTab, fields), fields, 0);
+    if (vt->nslots)
+        addreloc(w, fields + offsetof(ValTab, slots), slots, 0);
+    if (vt->narr)
+        addreloc(w, fields + offsetof(ValTab, arr), arr, 0);
+    w->tabs = addoff(w->tabs, &w->ntabs, fields);
+    for (int i = 0; i < vt->nslots; i++) {
+        Slot *sl = &vt->slots[i];
+        if (sl->key.type == V_NONE) continue;
+        uint32_t field = slots + i * sizeof(Slot);
+        writeval(w, field + offsetof(Slot, key), sl->key);
+        writeval(w, field + offsetof(Slot, value), sl->value);
+    }
+    for (int i = 0; i < vt->narr; i++)
+        writeval(w, arr + i * sizeof(Value), vt->arr[i]);
+    if (tab->proto)
+        addreloc(w, off + offsetof(ObjTab, proto),
+                writeobj(w, (Obj *)tab->proto), 0);
+    return off;
+}
+
+static uint32_t writearr(Writer *w, ObjArr *arr) {
+    uint32_t off = reserve(&w->fix, sizeof(ObjArr));
+    remember(w, (Obj *)arr, off);
+    uint32_t items = reserve(&w->fix, arr->len * sizeof(Value));
+    FIX(w, off, ObjArr)->hdr.type = OBJ_ARR;
+    FIX(w, off, ObjArr)->len = arr->len;
+    FIX(w, off, ObjArr)->cap = arr->len;
+    FIX(w, off, ObjArr)->mapped = 1;
+    if (arr->len)
+        addreloc(w, off + offsetof(ObjArr, items), items, 0);
+    w->arrs = addoff(w->arrs, &w->narrs, off);
+    for (int i = 0; i < arr->len; i++)
+        writeval(w, items + i * sizeof(Value), arr->items[i]);
+    return off;
+}
+
+static uint32_t writebuf(Writer *w, ObjBuf *buf) {
+    uint32_t off = reserve(&w->fix, sizeof(ObjBuf) + buf->len * sizeof(double));
+    remember(w, (Obj *)buf, off);
+    FIX(w, off, ObjBuf)->hdr.type = OBJ_BUF;
+    FIX(w, off, ObjBuf)->len = buf->len;
+    memcpy(FIX(w, off, ObjBuf)->data, buf->data, buf->len * sizeof(double));
+    return off;
+}
+
+// only the name is kept, the function is looked up again on loading
+static uint32_t writenative(Writer *w, ObjNative *n) {
+    uint32_t off = reserve(&w->fix, sizeof(ObjNative));
+    remember(w, (Obj *)n, off);
+    uint32_t name = writechars(w, n->name);
+    FIX(w, off, ObjNative)->hdr.type = OBJ_NATIVE;
+    FIX(w, off, ObjNative)->arity = n->arity;
+    addreloc(w, off + offsetof(ObjNative, name), name, 1);
+    w->natives = addoff(w->natives, &w->nnatives, off);
+    return off;
+}
+
+// slices are written as the strings they stand for
+static uint32_t writeobj(Writer *w, Obj *o) {
+    Seen *s = findseen(w, o);
+    if (s->obj) return s->off;
+    uint32_t off;
+    switch (o->type) {
+    case OBJ_STR:
+        off = writestr(w, (ObjString *)o);
+        remember(w, o, off);
+        return off;
+    case OBJ_SLICE:
+        off = writestr(w, strobj(OBJVAL(o)));
+        remember(w, o, off);
+        return off;
+    case OBJ_FUNC:
+        return writefunc(w, (ObjFunc *)o);
+    case OBJ_TAB:
+        return writetab(w, (ObjTab *)o);
+    case OBJ_ARR:
+        return writearr(w, (ObjArr *)o);
+    case OBJ_BUF:
+        return writebuf(w, (ObjBuf *)o);
+    case OBJ_NATIVE:
+        return writenative(w, (ObjNative *)o);
+    }
+    starfail("can't save object of type %i", o->type);
+}
+
+static void initwriter(Writer *w) {
+    memset(w, 0, sizeof(Writer));
+    w->relocs = newarray(sizeof(Reloc));
+    w->chunks = newarray(sizeof(uint32_t));
+    w->tabs = newarray(sizeof(uint32_t));
+    w->arrs = newarray(sizeof(uint32_t));
+    w->natives = newarray(sizeof(uint32_t));
+    w->seencap = 64;
+    w->seen = xmalloc(w->seencap * sizeof(Seen));
+    memset(w->seen, 0, w->seencap * sizeof(Seen));
+}
+
+static void freewriter(Writer *w) {
+    if (w->text.buf) xfree(w->text.buf);
+    if (w->fix.buf) xfree(w->fix.buf);
+    freearray(w->relocs);
+    freearray(w->chunks);
+    freearray(w->tabs);
+    freearray(w->arrs);
+    freearray(w->natives);
+    xfree(w->seen);
+}
+
+static uint32_t putlist(char *buf, uint32_t off, uint32_t *list, int n,
+        uint32_t base) {
+    uint32_t *dst = (uint32_t *)(buf + off);
+    for (int i = 0; i < n; i++)
+        dst[i] = base + list[i];
+    return off + align(n * sizeof(uint32_t));
+}
+
+// lays the two parts out after the header and turns every offset
+// into one from the start of the image
+static void finish(Writer *w, int hasroot, uint32_t root, uint32_t stack,
+        int nstack, uint32_t names, char *path) {
+    uint32_t textbase = align(sizeof(Header));
+    uint32_t fixbase = textbase + w->text.len;
+    uint32_t relocs = fixbase + w->fix.len;
+    uint32_t chunks = relocs + align(w->nrelocs * sizeof(uint32_t));
+    uint32_t tabs = chunks + align(w->nchunks * sizeof(uint32_t));
+    uint32_t arrs = tabs + align(w->ntabs * sizeof(uint32_t));
+    uint32_t natives = arrs + align(w->narrs * sizeof(uint32_t));
+    uint32_t size = natives + align(w->nnatives * sizeof(uint32_t));
+    char *buf = xmalloc(size);
+    memset(buf, 0, size);
+    if (w->text.len) memcpy(buf + textbase, w->text.buf, w->text.len);
+    if (w->fix.len) memcpy(buf + fixbase, w->fix.buf, w->fix.len);
+    uint64_t base = prefbase(&w->text);
+    uint32_t *list = (uint32_t *)(buf + relocs);
+    for (int i = 0; i < w->nrelocs; i++) {
+        Reloc r = w->relocs[i];
+        uintptr_t target = base + (r.text ? textbase : fixbase) + r.target;
+        memcpy(buf + fixbase + r.field, &target, sizeof(target));
+        list[i] = fixbase + r.field;
+    }
+    putlist(buf, chunks, w->chunks, w->nchunks, fixbase);
+    putlist(buf, tabs, w->tabs, w->ntabs, fixbase);
+    putlist(buf, arrs, w->arrs, w->narrs, fixbase);
+    putlist(buf, natives, w->natives, w->nnatives, fixbase);
+    Header *hdr = (Header *)buf;
+    memcpy(hdr->magic, MAGIC, 4);
+    hdr->version = IMAGE_VERSION;
+    hdr->abi = abi();
+    hdr->ops = opshash();
+    hdr->size = size;
+    hdr->root = hasroot ? fixbase + root : 0;
+    hdr->stack = fixbase + stack;
+    hdr->nstack = nstack;
+    hdr->names = fixbase + names;
+    hdr->relocs = relocs;
+    hdr->nrelocs = w->nrelocs;
+    hdr->chunks = chunks;
+    hdr->nchunks = w->nchunks;
+    hdr->tabs = tabs;
+    hdr->ntabs = w->ntabs;
+    hdr->arrs = arrs;
+    hdr->narrs = w->narrs;
+    hdr->natives = natives;
+    hdr->nnatives = w->nnatives;
+    hdr->base = base;
+    hdr->checksum = checksum(buf + sizeof(Header), size - sizeof(Header));
+    FILE *fp = fopen(path, "wb");
+    int ok = fp && fwrite(buf, size, 1, fp) == 1;
+    if (fp && fclose(fp)) ok = 0;
+    xfree(buf);
+    if (!ok)
+        starfail("can't write %s", path);
+}
+
+static void writeimage(ObjFunc *fn, Value *stack, char **names, int n,
+        char *path) {
+    Writer w;
+    ErrJmp ej;
+    initwriter(&w);
+    pusherr(&ej);
+    if (setjmp(ej.jb)) {
+        freewriter(&w);
+        starfail("%s", ej.msg);
+    }
+    uint32_t root = fn ? writeobj(&w, (Obj *)fn) : 0;
+    uint32_t vals = reserve(&w.fix, n * sizeof(Value));
+    uint32_t strs = reserve(&w.fix, n * sizeof(char *));
+    for (int i = 0; i < n; i++) {
+        writeval(&w, vals + i * sizeof(Value), stack[i]);
+        addreloc(&w, strs + i * sizeof(char *), writechars(&w, names[i]), 1);
+    }
+    finish(&w, fn != 0, root, vals, n, strs, path);
+    poperr(&ej);
+    freewriter(&w);
+}
+
+void saveimage(ObjFunc *fn, char *path) {
+    writeimage(fn, 0, 0, 0, path);
+}
+
+// the scope's locals are the bottom of the stack, as a script compiled
+// with keep leaves them
+void savesnapshot(Vm *vm, Scope *scope, char *path) {
+    if (vm->nstack < scope->nnames)
+        starfail("stack has %i values, the scope needs %i", vm->nstack,
+                scope->nnames);
+    writeimage(0, vm->stack, scope->names, scope->nnames, path);
+}
+
+int isimage(char *path) {
+    char magic[4];
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return 0;
+    int n = fread(magic, 1, 4, fp);
+    fclose(fp);
+    return n == 4 && memcmp(magic, MAGIC, 4) == 0;
+}
+
+static Header *header(Image *img) {
+    return (Header *)img->base;
+}
+
+// offsets come from the header, pointers from fixed up fields
+static void *at(Image *img, uint32_t off, uint32_t size) {
+    if (off < sizeof(Header) || off % ALIGN || off > img->size
+            || size > img->size - off)
+        starfail("corrupt image: offset %u out of range", off);
+    return img->base + off;
+}
+
+static void *in(Image *img, void *ptr, uint32_t size) {
+    if ((char *)ptr < img->base)
+        starfail("corrupt image: pointer out of range");
+    uintptr_t off = (char *)ptr - img->base;
+    if (off > UINT32_MAX)
+        starfail("corrupt image: pointer out of range");
+    return at(img, off, size);
+}
+
+static uint32_t *list(Image *img, uint32_t off, uint32_t n) {
+    if (n > img->size / sizeof(uint32_t))
+        starfail("corrupt image: list too long");
+    return at(img, off, n * sizeof(uint32_t));
+}
+
+// the writer lists chunks, tables, arrays and natives in the order it
+// lays them out, a loaded list has to be sorted the same way
+static uint32_t *sorted(Image *img, uint32_t off, uint32_t n) {
+    uint32_t *l = list(img, off, n);
+    for (uint32_t i = 1; i < n; i++)
+        if (l[i] <= l[i - 1])
+            starfail("corrupt image: list out of order");
+    return l;
+}
+
+// values may only point at objects that are listed, everything listed
+// gets checked
+static void listed(Image *img, uint32_t off, uint32_t n, void *ptr) {
+    uint32_t *l = (uint32_t *)(img->base + off);
+    uint32_t target = (char *)ptr - img->base;
+    uint32_t lo = 0, hi = n;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (l[mid] == target) return;
+        if (l[mid] < target) lo = mid + 1;
+        else hi = mid;
+    }
+    starfail("corrupt image: pointer to an unlisted object");
+}
+
+static void checkname(Image *img, char *name) {
+    in(img, name, 1);
+    if (!memchr(name, 0, img->base + img->size - name))
+        starfail("corrupt image: unterminated name");
+}
+
+static void checkval(Image *img, Value v) {
+    Header *hdr = header(img);
+    switch (v.type) {
+    case V_NUM: case V_BOOL: case V_NIL: return;
+    case V_OBJ: break;
+    default: starfail("corrupt image: bad value type %i", v.type);
+    }
+    Obj *o = in(img, v.as.obj, sizeof(Obj));
+    switch (o->type) {
+    case OBJ_STR: {
+        ObjString *str = in(img, o, sizeof(ObjString));
+        if (str->len < 0 || str->len > img->size)
+            starfail("corrupt image: bad string length");
+        in(img, o, sizeof(ObjString) + str->len + 1);
+        if (str->str[str->len])
+            starfail("corrupt image: unterminated string");
+        return;
+    }
+    case OBJ_FUNC: {
+        ObjFunc *fn = in(img, o, sizeof(ObjFunc));
+        if (fn->lazy)
+            starfail("corrupt image: function not compiled");
+        in(img, fn->chunk, sizeof(Chunk));
+        listed(img, hdr->chunks, hdr->nchunks, fn->chunk);
+        return;
+    }
+    case OBJ_TAB:
+        // prototypes aren't values anywhere else, they're checked here
+        for (int depth = 0; o; o = (Obj *)((ObjTab *)o)->proto, depth++) {
+            ObjTab *tab = in(img, o, sizeof(ObjTab));
+            if (tab->hdr.type != OBJ_TAB || depth > MAXPROTO)
+                starfail("corrupt image: bad prototype");
+            in(img, tab->fields, sizeof(ValTab));
+            listed(img, hdr->tabs, hdr->ntabs, tab->fields);
+        }
+        return;
+    case OBJ_ARR:
+        in(img, o, sizeof(ObjArr));
+        listed(img, hdr->arrs, hdr->narrs, o);
+        return;
+    case OBJ_BUF: {
+        ObjBuf *buf = in(img, o, sizeof(ObjBuf));
+        if (buf->len < 0 || buf->len > img->size / sizeof(double))
+            starfail("corrupt image: bad buffer length");
+        in(img, o, sizeof(ObjBuf) + buf->len * sizeof(double));
+        return;
+    }
+    case OBJ_NATIVE:
+        in(img, o, sizeof(ObjNative));
+        listed(img, hdr->natives, hdr->nnatives, o);
+        return;
+    }
+    starfail("corrupt image: bad object type %i", o->type);
+}
+
+static void checkcode(Chunk *c) {
+    for (int ip = 0; ip < c->nins; ip++) {
+        Ins i = c->ins[ip];
+        if (i.op < 0 || i.op >= NOPS)
+            starfail("corrupt image: bad opcode %i in %s", i.op, c->name);
+        switch (i.op) {
+        case OP_CONS:
+        case OP_GET_FIELD:
+        case OP_SET_FIELD:
+            if (i.arg < 0 || i.arg >= c->ncons)
+                starfail("corrupt image: constant %i out of range in %s",
+                        i.arg, c->name);
+            if (i.op != OP_CONS && (c->cons[i.arg].type != V_OBJ
+                    || c->cons[i.arg].as.obj->type != OBJ_STR))
+                starfail("corrupt image: field name isn't a string in %s",
+                        c->name);
+            if (i.op == OP_CONS && c->cons[i.arg].type == V_OBJ
+                    && c->cons[i.arg].as.obj->type == OBJ_TAB)
+                starfail("corrupt image: template used as a value in %s",
+                        c->name);
+            break;
+        case OP_NEW:
+            if (i.arg < 0 || i.arg > c->ncons)
+                starfail("corrupt image: constant %i out of range in %s",
+                        i.arg - 1, c->name);
+            if (i.arg && (c->cons[i.arg - 1].type != V_OBJ
+                    || c->cons[i.arg - 1].as.obj->type != OBJ_TAB))
+                starfail("corrupt image: template isn't a table in %s",
+                        c->name);
+            break;
+        case OP_JMP:
+        case OP_CJMP:
+        case OP_AND:
+        case OP_OR:
+            if (ip + i.arg < 0 || ip + i.arg > c->nins)
+                starfail("corrupt image: jump out of range in %s", c->name);
+            break;
+        case OP_ITER:
+            if (i.arg < 1 || ip + i.arg > c->nins)
+                starfail("corrupt image: jump out of range in %s", c->name);
+            break;
+        case OP_GUARD:
+            if (i.arg < 0 || i.arg >= c->ncons)
+                starfail("corrupt image: constant %i out of range in %s",
+                        i.arg, c->name);
+            if (ip + 1 >= c->nins)
+                starfail("corrupt image: guard at end of %s", c->name);
+            break;
+        case OP_SLIDE:
+            if (i.arg < 1)
+                starfail("corrupt image: bad slide in %s", c->name);
+            break;
+        case OP_GET_REG:
+        case OP_SET_REG:
+            if (i.arg < 0 || i.arg >= c->nregs)
+                starfail("corrupt image: register %i out of range in %s",
+                        i.arg, c->name);
+            break;
+        case OP_CALL:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_ARR:
+            if (i.arg < 0)
+                starfail("corrupt image: negative operand in %s", c->name);
+            break;
+        }
+    }
+}
+
+static void checkchunk(Image *img, Chunk *c) {
+    if (c->id != -1)
+        starfail("corrupt image: chunk listed twice");
+    if (c->nins < 0 || c->nins > img->size / sizeof(Ins)
+            || c->ncons < 0 || c->ncons > img->size / sizeof(Value)
+            || c->nregs < 0 || c->nregs > MAXREGS)
+        starfail("corrupt image: bad chunk size");
+    in(img, c->ins, c->nins * sizeof(Ins));
+    in(img, c->cons, c->ncons * sizeof(Value));
+    checkname(img, c->name);
+    for (int i = 0; i < c->ncons; i++)
+        checkval(img, c->cons[i]);
+    checkcode(c);
+}
+
+static void checktab(Image *img, ValTab *vt) {
+    if (!vt->mapped || vt->nslots < 0 || vt->nused < 0
+            || vt->nused > vt->nslots
+            || vt->nslots > img->size / sizeof(Slot)
+            || vt->narr < 0 || vt->narr > img->size / sizeof(Value))
+        starfail("corrupt image: bad table");
+    if (vt->nslots)
+        in(img, vt->slots, vt->nslots * sizeof(Slot));
+    // the counts steer growing and shrinking, they have to add up
+    int nused = 0, ndead = 0, narrused = 0;
+    for (int i = 0; i < vt->nslots; i++) {
+        Slot *sl = &vt->slots[i];
+        if (sl->key.type == V_NONE) continue;
+        if (sl->key.type == V_DEAD) {
+            ndead++;
+            continue;
+        }
+        nused++;
+        checkval(img, sl->key);
+        if (sl->key.type != V_NUM && (sl->key.type != V_OBJ
+                || sl->key.as.obj->type != OBJ_STR))
+            starfail("corrupt image: table key isn't a string or number");
+        if (sl->key.type == V_NUM && sl->key.as.num != sl->key.as.num)
+            starfail("corrupt image: table key is NaN");
+        checkval(img, sl->value);
+    }
+    if (vt->narr)
+        in(img, vt->arr, vt->narr * sizeof(Value));
+    for (int i = 0; i < vt->narr; i++) {
+        if (vt->arr[i].type == V_NONE) continue;
+        narrused++;
+        checkval(img, vt->arr[i]);
+    }
+    if (nused != vt->nused || ndead != vt->ndead || narrused != vt->narrused)
+        starfail("corrupt image: bad table counts");
+}
+
+static void checkarr(Image *img, ObjArr *arr) {
+    if (arr->hdr.type != OBJ_ARR || !arr->mapped || arr->len < 0
+            || arr->len != arr->cap || arr->len > img->size / sizeof(Value))
+        starfail("corrupt image: bad array");
+    if (!arr->len) return;
+    in(img, arr->items, arr->len * sizeof(Value));
+    for (int i = 0; i < arr->len; i++)
+        checkval(img, arr->items[i]);
+}
+
+static void checkheader(Image *img, char *path) {
+    Header *hdr = header(img);
+    if (img->size < sizeof(Header) || memcmp(hdr->magic, MAGIC, 4))
+        starfail("%s isn't an image", path);
+    if (hdr->version != IMAGE_VERSION)
+        starfail("%s is a version %i image, expected version %i, recompile it",
+                path, hdr->version, IMAGE_VERSION);
+    if (hdr->abi != abi() || hdr->ops != opshash())
+        starfail("%s was written by a different build, recompile it", path);
+    if (hdr->size != img->size)
+        starfail("corrupt image: %s is %u bytes, expected %u", path,
+                img->size, hdr->size);
+    if (checksum(img->base + sizeof(Header), img->size - sizeof(Header))
+            != hdr->checksum)
+        starfail("corrupt image: checksum mismatch in %s", path);
+}
+
+// a clone maps a file that was already checked, so only the pointers
+// are fixed up, and not even those when it got the preferred address.
+// Chunks left with id -1 get one when they're first profiled.
+static void relocate(Image *img, int check) {
+    Header *hdr = header(img);
+    uintptr_t delta = (uintptr_t)img->base - (uintptr_t)hdr->base;
+    if (!check && !delta) return;
+    uint32_t *relocs = list(img, hdr->relocs, hdr->nrelocs);
+    for (int i = 0; i < hdr->nrelocs; i++) {
+        uintptr_t *field = check
+            ? at(img, relocs[i], sizeof(uintptr_t))
+            : (uintptr_t *)(img->base + relocs[i]);
+        uintptr_t off = *field - (uintptr_t)hdr->base;
+        if (check && (off < sizeof(Header) || off > img->size))
+            starfail("corrupt image: pointer out of range");
+        *field += delta;
+    }
+    if (check) {
+        sorted(img, hdr->tabs, hdr->ntabs);
+        sorted(img, hdr->arrs, hdr->narrs);
+        sorted(img, hdr->natives, hdr->nnatives);
+    }
+    uint32_t *chunks = check ? sorted(img, hdr->chunks, hdr->nchunks)
+        : list(img, hdr->chunks, hdr->nchunks);
+    for (int i = 0; i < hdr->nchunks; i++) {
+        Chunk *c = at(img, chunks[i], sizeof(Chunk));
+        if (check) checkchunk(img, c);
+        c->id = newchunkid();
+    }
+    if (!check) return;
+    uint32_t *tabs = list(img, hdr->tabs, hdr->ntabs);
+    for (int i = 0; i < hdr->ntabs; i++)
+        checktab(img, at(img, tabs[i], sizeof(ValTab)));
+    uint32_t *arrs = list(img, hdr->arrs, hdr->narrs);
+    for (int i = 0; i < hdr->narrs; i++)
+        checkarr(img, at(img, arrs[i], sizeof(ObjArr)));
+    if (hdr->nstack > img->size / sizeof(Value))
+        starfail("corrupt image: stack too big");
+    Value *stack = at(img, hdr->stack, hdr->nstack * sizeof(Value));
+    char **names = at(img, hdr->names, hdr->nstack * sizeof(char *));
+    for (int i = 0; i < hdr->nstack; i++) {
+        checkval(img, stack[i]);
+        checkname(img, names[i]);
+    }
+    if (hdr->root) {
+        ObjFunc *fn = at(img, hdr->root, sizeof(ObjFunc));
+        if (fn->hdr.type != OBJ_FUNC)
+            starfail("corrupt image: root isn't a function");
+        checkval(img, OBJVAL(fn));
+    }
+}
+
+// function pointers aren't stored, every mapping looks its natives up
+// in this process's registry
+static void bindnatives(Image *img, int check) {
+    Header *hdr = header(img);
+    uint32_t *natives = list(img, hdr->natives, hdr->nnatives);
+    for (int i = 0; i < hdr->nnatives; i++) {
+        ObjNative *n = at(img, natives[i], sizeof(ObjNative));
+        if (check) {
+            if (n->hdr.type != OBJ_NATIVE)
+                starfail("corrupt image: bad native");
+            checkname(img, n->name);
+        }
+        ObjNative *def = findnative(n->name);
+        if (!def)
+            starfail("image needs native %s, which isn't defined", n->name);
+        if (def->arity != n->arity)
+            starfail("image expects native %s to take %i args, it takes %i",
+                    n->name, n->arity, def->arity);
+        n->fn = def->fn;
+    }
+}
+
+static Image *mapimage(int fd, uint32_t size, void *hint) {
+    char *base = mmap(hint, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        starfail("can't map image");
+    }
+    Image *img = xmalloc(sizeof(Image));
+    img->base = base;
+    img->size = size;
+    img->fd = fd;
+    return img;
+}
+
+static void unmap(Image *img) {
+    munmap(img->base, img->size);
+    close(img->fd);
+    xfree(img);
+}
+
+Image *loadimage(char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        starfail("can't open %s", path);
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < sizeof(Header) || st.st_size > UINT32_MAX) {
+        close(fd);
+        starfail("%s isn't an image", path);
+    }
+    Image *img = mapimage(fd, st.st_size, 0);
+    ErrJmp ej;
+    pusherr(&ej);
+    if (setjmp(ej.jb)) {
+        unmap(img);
+        starfail("%s", ej.msg);
+    }
+    checkheader(img, path);
+    relocate(img, 1);
+    bindnatives(img, 1);
+    poperr(&ej);
+    return img;
+}
+
+// another private copy of the same file, for starting one more vm
+// from a snapshot. loadimage maps anywhere so the preferred address is
+// left for clones, one at a time gets it and costs next to nothing.
+Image *cloneimage(Image *img) {
+    int fd = dup(img->fd);
+    if (fd < 0)
+        starfail("can't clone image");
+    Image *clone = mapimage(fd, img->size, (void *)(uintptr_t)header(img)->base);
+    relocate(clone, 0);
+    bindnatives(clone, 0);
+    return clone;
+}
+
+ObjFunc *imagefunc(Image *img) {
+    uint32_t root = header(img)->root;
+    return root ? (ObjFunc *)(img->base + root) : 0;
+}
+
+Scope *imagescope(Image *img) {
+    Header *hdr = header(img);
+    char **names = (char **)(img->base + hdr->names);
+    Scope *s = newscope();
+    for (int i = 0; i < hdr->nstack; i++)
+        scopeadd(s, names[i]);
+    return s;
+}
+
+// the values become the bottom of the vm's stack, they stay valid
+// until the image is freed
+void starrestore(Vm *vm, Image *img) {
+    Header *hdr = header(img);
+    vm->stack = arraygrow(vm->stack, hdr->nstack);
+    memcpy(vm->stack, img->base + hdr->stack, hdr->nstack * sizeof(Value));
+    vm->nstack = vm->nbase = hdr->nstack;
+}
+
+// tables and arrays from the image that grew while running own their
+// new storage
+void freeimage(Image *img) {
+    Header *hdr = header(img);
+    uint32_t *tabs = (uint32_t *)(img->base + hdr->tabs);
+    for (int i = 0; i < hdr->ntabs; i++) {
+        ValTab *vt = (ValTab *)(img->base + tabs[i]);
+        if (vt->mapped) continue;
+        if (vt->slots) xfree(vt->slots);
+        if (vt->arr) xfree(vt->arr);
+    }
+    uint32_t *arrs = (uint32_t *)(img->base + hdr->arrs);
+    for (int i = 0; i < hdr->narrs; i++) {
+        ObjArr *arr = (ObjArr *)(img->base + arrs[i]);
+        if (!arr->mapped) xfree(arr->items);
+    }
+    unmap(img);
+}
+
+int starsave(Vm *vm, ObjFunc *fn, char *path) {
+    ErrJmp ej;
+    pusherr(&ej);
+    if (setjmp(ej.jb)) {
+        strcpy(vm->err, ej.msg);
+        return STAR_ERR;
+    }
+    saveimage(fn, path);
+    poperr(&ej);
+    return STAR_OK;
+}
+
+int starsnapshot(Vm *vm, Scope *scope, char *path) {
+    ErrJmp ej;
+    pusherr(&ej);
+    if (setjmp(ej.jb)) {
+        strcpy(vm->err, ej.msg);
+        return STAR_ERR;
+    }
+    savesnapshot(vm, scope, path);
+    poperr(&ej);
+    return STAR_OK;
+}
+
+int starload(Vm *vm, char *path, Image **img) {
+    ErrJmp ej;
+    pusherr(&ej);
+    if (setjmp(ej.jb)) {
+        strcpy(vm->err, ej.msg);
+        *img = 0;
+        return STAR_ERR;
+    }
+    *img = loadimage(path);
+    poperr(&ej);
+    return STAR_OK;
+}
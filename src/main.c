@@ -2,17 +2,38 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <star/mem.h>
 #include <star/util.h>
 #include <star/star.h>
+#include <star/prof.h>
+#include <star/cache.h>
+#include <star/image.h>
+#include <star/opt.h>
+
+// lines typed again in the REPL aren't compiled again
+#define CACHEBYTES (1 << 20)
 
 static char *OPTS[] = {
     "-i:interactive (REPL)",
+    "-q:quiet, no chunk, stack or memory dumps",
+    "-p:profile opcodes, functions and instructions",
+    "-n:don't inline functions or take tables apart (to compare)",
+    "-j file:write the profile as JSON to file",
+    "-s file:sample call stacks into file (folded, for flamegraphs)",
+    "-f hz:sampling frequency (default 1000)",
+    "-c file:compile only, write a bytecode image to file",
+    "-S file:keep the script's top-level locals, snapshot them to file",
+    "-R file:start from a snapshot, its locals are in scope",
     0,
 };
 
 static void usage() {
     printf("Usage: star [options] file\n");
+    printf("file is a script or an image written by -c, - reads stdin\n");
     printf("Options:\n");
     for (char **opt = OPTS; *opt; opt++) {
         char *sep = strchr(*opt, ':');
@@ -21,17 +42,94 @@ static void usage() {
     exit(1);
 }
 
-static char *readfile(char *path) {
-    FILE *fp = fopen(path, "r");
-    if (!fp) exit(1);
-    fseek(fp, 0, SEEK_END);
-    int size = ftell(fp);
-    char *src = xmalloc(size + 1);
-    rewind(fp);
-    fread(src, size, 1, fp);
-    src[size] = 0;
+// - and anything that isn't a regular file (pipes, ttys) is a stream
+static int isstream(char *path) {
+    struct stat st;
+    if (strcmp(path, "-") == 0) return 1;
+    return stat(path, &st) == 0 && !S_ISREG(st.st_mode);
+}
+
+// regular files are mapped rather than read in, streams are compiled a
+// window at a time, neither is ever copied whole
+static int compilefile(Vm *vm, char *path, Scope *scope, int keep, ObjFunc **fn) {
+    if (isstream(path)) {
+        FILE *fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+        if (!fp) {
+            printf("*** can't open %s\n", path);
+            exit(1);
+        }
+        int status = starcompilefp(vm, fp, scope, keep, fn);
+        if (fp != stdin) fclose(fp);
+        return status;
+    }
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        printf("*** can't open %s\n", path);
+        exit(1);
+    }
+    size_t len = st.st_size;
+    char *src = len ? mmap(0, len, PROT_READ, MAP_PRIVATE, fd, 0) : "";
+    close(fd);
+    if (src == MAP_FAILED) {
+        printf("*** can't map %s\n", path);
+        exit(1);
+    }
+    if (len) madvise(src, len, MADV_SEQUENTIAL);
+    int status = starcompilen(vm, src, len, scope, keep, fn);
+    if (len) munmap(src, len);
+    return status;
+}
+
+static void startprof(Vm *vm) {
+#ifdef STAR_PROF
+    vm->prof = newprof();
+#else
+    printf("*** profiling not compiled in, build with PROF=1\n");
+    exit(1);
+#endif
+}
+
+static void endprof(Vm *vm, char *json) {
+    if (!vm->prof) return;
+    profreport(vm->prof, stdout);
+    OptStats os = optstats();
+    printf("Optimizer:\n    %i call sites, %i inlined, %i of them guarded\n",
+            os.sites, os.inlined, os.guarded);
+    printf("    %i tables kept in registers\n", os.tables);
+    if (json) {
+        FILE *fp = fopen(json, "w");
+        if (!fp) {
+            printf("*** can't open %s\n", json);
+            exit(1);
+        }
+        profjson(vm->prof, fp);
+        fclose(fp);
+    }
+    freeprof(vm->prof);
+    vm->prof = 0;
+}
+
+static Sampler *startsample(Vm *vm, int hz) {
+#ifdef STAR_PROF
+    return startsampler(vm, hz);
+#else
+    printf("*** sampling not compiled in, build with PROF=1\n");
+    exit(1);
+#endif
+}
+
+static void endsample(Sampler *s, char *folded) {
+    stopsampler(s);
+    FILE *fp = fopen(folded, "w");
+    if (!fp) {
+        printf("*** can't open %s\n", folded);
+        exit(1);
+    }
+    writefolded(s, fp);
     fclose(fp);
-    return src;
+    samplerstats(s, stdout);
+    freesampler(s);
 }
 
 static int emptyline(char *line) {
@@ -43,42 +141,140 @@ static int emptyline(char *line) {
 int main(int argc, char **argv) {
     char line[1024];
     int repl = 0;
+    int quiet = 0;
+    int prof = 0;
+    char *json = 0;
+    char *folded = 0;
+    int hz = 1000;
     char *file = 0;
+    char *image = 0;
+    char *snapshot = 0;
+    char *restorefrom = 0;
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-i") == 0) repl = 1;
+        else if (strcmp(argv[i], "-q") == 0) quiet = 1;
+        else if (strcmp(argv[i], "-p") == 0) prof = 1;
+        else if (strcmp(argv[i], "-n") == 0) optinline = 0;
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            prof = 1;
+            json = argv[++i];
+        }
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            folded = argv[++i];
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+            hz = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+            image = argv[++i];
+        else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc)
+            snapshot = argv[++i];
+        else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc)
+            restorefrom = argv[++i];
         else if (!file) file = argv[i];
         else printf("*** unknown option %s\n", argv[i]);
     }
+    if (repl && folded) {
+        printf("*** sampling is not supported in the REPL\n");
+        exit(1);
+    }
     if (repl) {
         Vm *vm = newvm();
+        Cache *cache = newcache(CACHEBYTES);
+        if (prof) startprof(vm);
         printf("star repl\n");
         for (;;) {
             printf("> ");
             if (!fgets(line, sizeof(line), stdin)) break;
             if (emptyline(line)) continue;
-            ObjFunc *fn = compile(line);
-            printchunk(fn->chunk);
-            runchunk(vm, fn->chunk);
-            printstack(vm);
-            freechunk(fn->chunk);
+            ObjFunc *fn;
+            if (cachecompile(cache, vm, line, &fn) != STAR_OK) {
+                printf("*** %s\n", starerror(vm));
+                continue;
+            }
+            if (!quiet) printchunk(fn->chunk);
+            if (starrun(vm, fn) != STAR_OK)
+                printf("*** %s\n", starerror(vm));
+            else if (!quiet)
+                printstack(vm);
+            resetvm(vm);
+            cacherelease(cache, fn);
         }
+        endprof(vm, json);
+        if (!quiet) printcache(cache);
+        freecache(cache);
         freevm(vm);
     }
     else if (!file) {
         usage();
     }
     else {
-        printmem();
-        char *src = readfile(file);
-        ObjFunc *fn = compile(src);
-        xfree(src);
+        if (!quiet) printmem();
         Vm *vm = newvm();
-        printchunk(fn->chunk);
-        runchunk(vm, fn->chunk);
-        printstack(vm);
-        freechunk(fn->chunk);
+        ObjFunc *fn;
+        Image *img = 0;
+        Image *snap = 0;
+        Scope *scope = 0;
+        if (restorefrom) {
+            if (starload(vm, restorefrom, &snap) != STAR_OK) {
+                printf("*** %s\n", starerror(vm));
+                exit(1);
+            }
+            starrestore(vm, snap);
+            scope = imagescope(snap);
+        }
+        else if (snapshot) {
+            scope = newscope();
+        }
+        if (!isstream(file) && isimage(file)) {
+            if (starload(vm, file, &img) != STAR_OK) {
+                printf("*** %s\n", starerror(vm));
+                exit(1);
+            }
+            if (!(fn = imagefunc(img))) {
+                printf("*** %s has no script to run\n", file);
+                exit(1);
+            }
+        }
+        else {
+            if (compilefile(vm, file, scope, snapshot != 0, &fn) != STAR_OK) {
+                printf("*** %s\n", starerror(vm));
+                exit(1);
+            }
+        }
+        if (image) {
+            if (starsave(vm, fn, image) != STAR_OK) {
+                printf("*** %s\n", starerror(vm));
+                exit(1);
+            }
+            if (img) freeimage(img);
+            else freefunc(fn);
+            if (scope) freescope(scope);
+            if (snap) freeimage(snap);
+            freevm(vm);
+            if (!quiet) printmem();
+            return 0;
+        }
+        if (prof) startprof(vm);
+        if (!quiet) printchunk(fn->chunk);
+        Sampler *sampler = folded ? startsample(vm, hz) : 0;
+        int status = starrun(vm, fn);
+        if (sampler) endsample(sampler, folded);
+        if (status != STAR_OK) {
+            printf("*** %s\n", starerror(vm));
+            exit(1);
+        }
+        if (!quiet) printstack(vm);
+        endprof(vm, json);
+        if (snapshot && starsnapshot(vm, scope, snapshot) != STAR_OK) {
+            printf("*** %s\n", starerror(vm));
+            exit(1);
+        }
+        if (img) freeimage(img);
+        else freefunc(fn);
+        if (scope) freescope(scope);
+        resetvm(vm);
+        if (snap) freeimage(snap);
         freevm(vm);
-        printmem();
+        if (!quiet) printmem();
     }
     return 0;
 }
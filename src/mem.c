@@ -2,7 +2,9 @@
 #include <stdlib.h>
 #include <stdio.h>
 
-static int _allocated = 0;
+// per thread so vms on different threads don't race on the counters
+static _Thread_local int _allocated = 0;
+static _Thread_local int _peak = 0;
 
 typedef struct {
     int size;
@@ -13,6 +15,7 @@ void *xmalloc(int size) {
     Hdr *hdr = malloc(sizeof(Hdr) + size);
     hdr->size = size;
     _allocated += size;
+    if (_allocated > _peak) _peak = _allocated;
     return hdr + 1;
 }
 
@@ -21,6 +24,7 @@ void *xrealloc(void *ptr, int size) {
     _allocated -= hdr->size;
     hdr = realloc(hdr, sizeof(Hdr) + size);
     _allocated += size;
+    if (_allocated > _peak) _peak = _allocated;
     hdr->size = size;
     return hdr + 1;
 }
@@ -32,5 +36,9 @@ void xfree(void *ptr) {
 }
 
 void printmem() {
-    printf("%i bytes allocated\n", _allocated);
+    printf("%i bytes allocated, %i peak\n", _allocated, _peak);
+}
+
+int memused() {
+    return _allocated;
 }
@@ -0,0 +1,53 @@
+#include <pthread.h>
+#include <string.h>
+#include <star/util.h>
+#include <star/star.h>
+#include <star/builtin.h>
+
+// entries never move, so compiled code can hold on to them
+#define MAXNATIVES 256
+
+static ObjNative natives[MAXNATIVES];
+static int nnatives;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static ObjNative *find(char *name) {
+    for (int i = 0; i < nnatives; i++)
+        if (strcmp(natives[i].name, name) == 0) return &natives[i];
+    return 0;
+}
+
+static void define(char *name, int arity, NativeFn fn) {
+    pthread_mutex_lock(&lock);
+    ObjNative *n = find(name);
+    if (!n && nnatives == MAXNATIVES) {
+        pthread_mutex_unlock(&lock);
+        starfail("too many natives, %s is one more than %i", name, MAXNATIVES);
+    }
+    if (!n) n = &natives[nnatives++];
+    n->hdr.type = OBJ_NATIVE;
+    n->hdr.next = 0;
+    n->name = name;
+    n->arity = arity;
+    n->fn = fn;
+    pthread_mutex_unlock(&lock);
+}
+
+static void init() {
+    defbuiltins(define);
+}
+
+// name isn't copied, it has to outlive the registry
+void defnative(char *name, int arity, NativeFn fn) {
+    pthread_once(&once, init);
+    define(name, arity, fn);
+}
+
+ObjNative *findnative(char *name) {
+    pthread_once(&once, init);
+    pthread_mutex_lock(&lock);
+    ObjNative *n = find(name);
+    pthread_mutex_unlock(&lock);
+    return n;
+}
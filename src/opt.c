@@ -0,0 +1,856 @@
+#include <string.h>
+#include <star/mem.h>
+#include <star/util.h>
+#include <star/star.h>
+#include <star/opt.h>
+
+// callees longer than this (up to their RET) are left as calls
+#define MAXBODY 16
+// lazy bodies longer than this aren't compiled early just to look at
+#define MAXLAZY 256
+// chunks whose block states would take more slots are left alone
+#define MAXSLOTS (1 << 22)
+// inlining again can reach calls on what the last round inlined
+#define MAXROUNDS 3
+// escapes found can make more code reachable, which can find more
+#define MAXPASSES 8
+
+int optinline = 1;
+static _Thread_local OptStats stats;
+
+OptStats optstats() {
+    return stats;
+}
+
+enum { A_UNKNOWN, A_FUNC, A_TAB, A_FIELD };
+
+// what's known about a stack slot: it holds function constant k, the
+// table made by the NEW at ip, or function constant k as read by the
+// GET_FIELD at ip from such a table's literal, which has to be checked
+// when it runs unless the table is known not to change
+typedef struct {
+    char kind;
+    int k;
+    int ip;
+} Abs;
+
+// the stack on entry to a block, only kept for block leaders
+typedef struct {
+    Abs *slots;
+    int depth;
+    char seen;
+    char queued;
+} State;
+
+// a field set by a table literal, func is the function constant it's
+// set to or -1, nested the NEW of a literal it's set to or -1, val what
+// it holds wherever it's set and reg where it's kept if the table is
+// replaced
+typedef struct {
+    int name;
+    int func;
+    int nested;
+    int reg;
+    Abs val;
+    char hasval;
+} Field;
+
+// complete once the literal's end was found, before that later fields
+// could be anything
+typedef struct {
+    Field *fields;
+    int nfields;
+    int end;
+    char parsed;
+    char complete;
+} Lit;
+
+// a table escapes when anything but a local, DUP, SWAP, POP or a field
+// access by a name its literal sets touches it, or when it can't be
+// told apart from other values or an older table from the same NEW.
+// Only a literal nested in another's can be kept in a field, it escapes
+// with the outer one. Per table arrays are indexed by the NEW's ip.
+typedef struct {
+    Chunk *c;
+    int nins;
+    int keep;
+    char *leader;
+    State *states;
+    long nslots;
+    int *work;
+    int nwork;
+    Abs *stack;
+    int depth;
+    int fail;
+    Lit *lits;
+    int *init;
+    char *escaped;
+    char *written;
+    int changed;
+    Abs *recv;
+    // filled in by the last pass: what each CALL calls, the depth it's
+    // made at, whether a GET_FIELD's result is the only value
+    // abstracted by its ip and which GUARDs can't fail
+    Abs *callee;
+    int *calldepth;
+    char *fresh;
+    char *sure;
+} Flow;
+
+static const Abs unknown;
+// where slot points a bad index, so the caller has something to write
+static _Thread_local Abs scratch;
+
+static void push(Flow *f, Abs v) {
+    f->stack = arraygrow(f->stack, f->depth + 1);
+    f->stack[f->depth++] = v;
+}
+
+static Abs pop(Flow *f) {
+    if (!f->depth) {
+        f->fail = 1;
+        return unknown;
+    }
+    return f->stack[--f->depth];
+}
+
+static int isfunc(Value v) {
+    return v.type == V_OBJ && v.as.obj->type == OBJ_FUNC;
+}
+
+static int samestr(Value a, Value b) {
+    ObjString *x = (ObjString *)a.as.obj, *y = (ObjString *)b.as.obj;
+    return x->len == y->len && memcmp(x->str, y->str, x->len) == 0;
+}
+
+static int sameabs(Abs a, Abs b) {
+    return a.kind == b.kind && a.k == b.k && a.ip == b.ip;
+}
+
+static int countabs(Flow *f, Abs v) {
+    int n = 0;
+    for (int k = 0; k < f->depth; k++)
+        n += sameabs(f->stack[k], v);
+    return n;
+}
+
+static int isjump(int op) {
+    switch (op) {
+    case OP_JMP: case OP_CJMP: case OP_AND: case OP_OR: case OP_ITER:
+        return 1;
+    }
+    return 0;
+}
+
+// stack effect of the instruction when it falls through
+static int effect(Ins i) {
+    switch (i.op) {
+    case OP_CONS: case OP_NIL: case OP_TRUE: case OP_FALSE: case OP_NEW:
+    case OP_DUP: case OP_GET_LOCAL:
+        return 1;
+    case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV:
+    case OP_LT: case OP_GT: case OP_EQ: case OP_GET_INDEX:
+    case OP_PRINT: case OP_POP: case OP_SET_FIELD: case OP_SET_REG:
+    case OP_CJMP: case OP_AND: case OP_OR:
+        return -1;
+    case OP_SET_INDEX: case OP_DELETE: return -2;
+    case OP_CALL: case OP_SLIDE: return -i.arg;
+    case OP_ARR: return 1 - i.arg;
+    }
+    return 0;
+}
+
+static void escape(Flow *f, Abs v) {
+    if (v.kind != A_TAB || !f->escaped || f->escaped[v.ip]) return;
+    f->escaped[v.ip] = 1;
+    f->changed = 1;
+    Lit *l = &f->lits[v.ip];
+    for (int k = 0; k < l->nfields; k++)
+        if (l->fields[k].hasval) escape(f, l->fields[k].val);
+}
+
+// follows the literal after the NEW at x one field at a time: DUP, the
+// value, SET_FIELD, POP
+static Lit *lit(Flow *f, int x) {
+    Lit *l = &f->lits[x];
+    if (l->parsed) return l;
+    Chunk *c = f->c;
+    l->parsed = 1;
+    l->fields = newarray(sizeof(Field));
+    int ip = x + 1;
+    while (ip < c->nins && c->ins[ip].op == OP_DUP) {
+        int start = ++ip, d = 2;
+        for (; ip < c->nins && d >= 2; ip++) {
+            Ins i = c->ins[ip];
+            if (i.op == OP_SET_FIELD && d == 3) break;
+            if (i.op == OP_RET || i.op == OP_JMP || i.op == OP_CJMP
+                    || i.op == OP_ITER || i.op == OP_GUARD)
+                return l;
+            d += effect(i);
+        }
+        if (ip + 1 >= c->nins || c->ins[ip].op != OP_SET_FIELD
+                || c->ins[ip + 1].op != OP_POP)
+            return l;
+        Ins v = c->ins[start];
+        Field fl = {c->ins[ip].arg, -1, -1, -1};
+        if (ip == start + 1 && v.op == OP_CONS && isfunc(c->cons[v.arg]))
+            fl.func = v.arg;
+        if (v.op == OP_NEW && lit(f, start)->complete
+                && f->lits[start].end == ip)
+            fl.nested = start;
+        l->fields = arraygrow(l->fields, l->nfields + 1);
+        l->fields[l->nfields++] = fl;
+        f->init[ip] = x + 1;
+        ip += 2;
+    }
+    l->end = ip;
+    l->complete = 1;
+    return l;
+}
+
+// the last field of the literal named like the constant, the one whose
+// value the table ends up with
+static Field *field(Flow *f, int x, int name) {
+    Lit *l = lit(f, x);
+    if (!l->complete) return 0;
+    for (int k = l->nfields - 1; k >= 0; k--)
+        if (samestr(f->c->cons[l->fields[k].name], f->c->cons[name]))
+            return &l->fields[k];
+    return 0;
+}
+
+static Abs *slot(Flow *f, int idx) {
+    if (idx < 0 || idx >= f->depth) {
+        f->fail = 1;
+        return &scratch;
+    }
+    return &f->stack[idx];
+}
+
+// what a field holds is the same everywhere, so a table kept in it can
+// only be read back as long as nothing else is ever stored there
+static void store(Flow *f, Field *fl, Abs v) {
+    if (!fl->hasval) {
+        fl->val = v;
+        fl->hasval = 1;
+    }
+    else if (!sameabs(fl->val, v)) {
+        escape(f, fl->val);
+        escape(f, v);
+        if (fl->val.kind != A_UNKNOWN) f->changed = 1;
+        fl->val = unknown;
+    }
+}
+
+static Abs use(Flow *f) {
+    Abs v = pop(f);
+    escape(f, v);
+    return v;
+}
+
+// applies the instruction at ip to the abstract stack, jumps only for
+// their effect on the fallthrough. Without lits tables aren't followed.
+static void step(Flow *f, int ip) {
+    Chunk *c = f->c;
+    Ins i = c->ins[ip];
+    Abs v, w;
+    Field *fl;
+    switch (i.op) {
+    case OP_NOP: case OP_JMP: case OP_RET: case OP_GUARD: break;
+    case OP_CONS:
+        push(f, isfunc(c->cons[i.arg]) ? (Abs){A_FUNC, i.arg} : unknown);
+        break;
+    case OP_NIL: case OP_TRUE: case OP_FALSE: push(f, unknown); break;
+    case OP_NEW:
+        if (!f->lits) {
+            push(f, unknown);
+            break;
+        }
+        v = (Abs){A_TAB, 0, ip};
+        if (countabs(f, v)) escape(f, v);
+        push(f, v);
+        break;
+    case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV:
+    case OP_LT: case OP_GT: case OP_EQ:
+    case OP_GET_INDEX:
+        use(f);
+        use(f);
+        push(f, unknown);
+        break;
+    case OP_NEG: case OP_NOT: case OP_LEN: case OP_GET_REG:
+        use(f);
+        push(f, unknown);
+        break;
+    case OP_PRINT: case OP_CJMP: case OP_AND: case OP_OR:
+        use(f);
+        break;
+    case OP_POP: pop(f); break;
+    case OP_GET_LOCAL: push(f, *slot(f, i.arg)); break;
+    case OP_SET_LOCAL:
+        v = pop(f);
+        *slot(f, i.arg) = v;
+        push(f, v);
+        break;
+    case OP_GET_FIELD:
+        v = pop(f);
+        if (f->recv) f->recv[ip] = v;
+        fl = v.kind == A_TAB ? field(f, v.ip, i.arg) : 0;
+        if (!fl) escape(f, v);
+        if (fl && fl->func >= 0)
+            push(f, (Abs){A_FIELD, fl->func, ip});
+        else
+            push(f, fl && fl->hasval && fl->val.kind == A_TAB ? fl->val : unknown);
+        break;
+    case OP_SET_FIELD:
+        v = pop(f);
+        w = pop(f);
+        if (f->recv) f->recv[ip] = w;
+        fl = w.kind == A_TAB ? field(f, w.ip, i.arg) : 0;
+        if (!fl) {
+            escape(f, w);
+            escape(f, v);
+        }
+        else if (f->init[ip] == w.ip + 1) {
+            if (v.kind != A_TAB || v.ip != fl->nested) escape(f, v);
+            store(f, fl, v);
+        }
+        else {
+            escape(f, v);
+            store(f, fl, v);
+            if (!f->written[w.ip]) f->written[w.ip] = f->changed = 1;
+        }
+        push(f, v);
+        break;
+    case OP_SET_REG:
+        v = use(f);
+        use(f);
+        push(f, v);
+        break;
+    case OP_SWAP:
+        v = pop(f);
+        w = pop(f);
+        push(f, v);
+        push(f, w);
+        break;
+    case OP_DUP:
+        v = pop(f);
+        push(f, v);
+        push(f, v);
+        break;
+    case OP_CALL:
+        for (int n = 0; n <= i.arg; n++) use(f);
+        push(f, unknown);
+        break;
+    case OP_ARR:
+        for (int n = 0; n < i.arg; n++) use(f);
+        push(f, unknown);
+        break;
+    case OP_SET_INDEX:
+        v = use(f);
+        use(f);
+        use(f);
+        push(f, v);
+        break;
+    case OP_DELETE:
+        use(f);
+        use(f);
+        break;
+    case OP_ITER:
+        for (int n = 1; n <= 3; n++) escape(f, *slot(f, f->depth - n));
+        *slot(f, f->depth - 1) = unknown;
+        *slot(f, f->depth - 2) = unknown;
+        break;
+    case OP_SLIDE:
+        v = pop(f);
+        for (int n = 0; n < i.arg; n++) pop(f);
+        push(f, v);
+        break;
+    default:
+        f->fail = 1;
+    }
+}
+
+// merges the current stack into the state on entry to ip, a table
+// that only reaches it on some paths escapes
+static void flow(Flow *f, int ip) {
+    if (ip < 0 || ip > f->c->nins) {
+        f->fail = 1;
+        return;
+    }
+    if (ip == f->c->nins) return;
+    State *s = &f->states[ip];
+    int changed = 0;
+    if (!s->seen) {
+        f->nslots += f->depth;
+        if (f->nslots > MAXSLOTS) {
+            f->fail = 1;
+            return;
+        }
+        s->seen = 1;
+        s->depth = f->depth;
+        s->slots = xmalloc(f->depth * sizeof(Abs) + 1);
+        memcpy(s->slots, f->stack, f->depth * sizeof(Abs));
+        changed = 1;
+    }
+    else if (s->depth != f->depth) {
+        f->fail = 1;
+        return;
+    }
+    else {
+        for (int k = 0; k < s->depth; k++) {
+            if (s->slots[k].kind != A_UNKNOWN
+                    && !sameabs(s->slots[k], f->stack[k])) {
+                escape(f, s->slots[k]);
+                s->slots[k] = unknown;
+                changed = 1;
+            }
+            if (s->slots[k].kind == A_UNKNOWN)
+                escape(f, f->stack[k]);
+        }
+    }
+    if (changed && !s->queued) {
+        s->queued = 1;
+        f->work = arraygrow(f->work, f->nwork + 1);
+        f->work[f->nwork++] = ip;
+    }
+}
+
+// a GUARD can't fail if the field it checks was read from a table that
+// doesn't escape and whose fields keep their literal's values
+static int guarded(Flow *f, int ip) {
+    Ins i = f->c->ins[ip];
+    if (!f->depth || ip == 0 || f->c->ins[ip - 1].op != OP_GET_FIELD)
+        return 0;
+    Abs v = f->stack[f->depth - 1], t = f->recv[ip - 1];
+    return v.kind == A_FIELD && v.k == i.arg && v.ip == ip - 1
+        && t.kind == A_TAB && !f->escaped[t.ip] && !f->written[t.ip];
+}
+
+// runs the block starting at ip, with last set it records call sites
+static void block(Flow *f, int ip, int last) {
+    State *s = &f->states[ip];
+    f->depth = s->depth;
+    f->stack = arraygrow(f->stack, f->depth + 1);
+    memcpy(f->stack, s->slots, s->depth * sizeof(Abs));
+    for (; ip < f->c->nins && !f->fail; ip++) {
+        Ins i = f->c->ins[ip];
+        if (last && i.op == OP_CALL && f->depth > i.arg) {
+            f->callee[ip] = f->stack[f->depth - 1 - i.arg];
+            f->calldepth[ip] = f->depth;
+        }
+        if (i.op == OP_RET) {
+            // a function's locals go away, its result and with keep the
+            // top-level locals don't
+            for (int k = f->keep ? 0 : f->depth - 1; k < f->depth; k++)
+                escape(f, f->stack[k]);
+            return;
+        }
+        if (i.op == OP_GUARD) {
+            int sure = guarded(f, ip);
+            if (last) f->sure[ip] = sure;
+            flow(f, ip + 2);
+            if (!sure) flow(f, ip + 1);
+            return;
+        }
+        if (i.op == OP_AND || i.op == OP_OR)
+            flow(f, ip + i.arg);
+        step(f, ip);
+        if (last && i.op == OP_GET_FIELD && f->depth)
+            f->fresh[ip] = countabs(f, f->stack[f->depth - 1]) == 1;
+        if (isjump(i.op) && i.op != OP_AND && i.op != OP_OR)
+            flow(f, ip + i.arg);
+        if (i.op == OP_JMP) return;
+        if (isjump(i.op) || (ip + 1 < f->c->nins && f->leader[ip + 1])) {
+            flow(f, ip + 1);
+            return;
+        }
+    }
+}
+
+static int pass(Flow *f, int depth) {
+    for (int ip = 0; ip < f->c->nins; ip++)
+        if (f->states[ip].slots) xfree(f->states[ip].slots);
+    memset(f->states, 0, (f->c->nins + 1) * sizeof(State));
+    memset(f->recv, 0, (f->c->nins + 1) * sizeof(Abs));
+    f->nslots = 0;
+    f->nwork = 0;
+    f->depth = 0;
+    for (int k = 0; k < depth; k++) push(f, unknown);
+    flow(f, 0);
+    while (f->nwork && !f->fail) {
+        int ip = f->work[--f->nwork];
+        f->states[ip].queued = 0;
+        block(f, ip, 0);
+    }
+    return !f->fail;
+}
+
+// every table is taken not to escape until shown otherwise, which can
+// make guards on it sure and their slow paths unreachable. Escapes only
+// accumulate, passes are repeated until they stop changing.
+static int analyse(Flow *f, int depth) {
+    Chunk *c = f->c;
+    f->leader[0] = 1;
+    for (int ip = 0; ip < c->nins; ip++) {
+        Ins i = c->ins[ip];
+        if (isjump(i.op)) {
+            int to = ip + i.arg;
+            if (to < 0 || to > c->nins) return 0;
+            if (to < c->nins) f->leader[to] = 1;
+        }
+        if ((isjump(i.op) || i.op == OP_RET) && ip + 1 < c->nins)
+            f->leader[ip + 1] = 1;
+        if (i.op == OP_GUARD && ip + 2 < c->nins)
+            f->leader[ip + 1] = f->leader[ip + 2] = 1;
+    }
+    int passes = 0;
+    do {
+        f->changed = 0;
+        if (!pass(f, depth)) return 0;
+        if (f->changed && ++passes == MAXPASSES) {
+            memset(f->escaped, 1, c->nins + 1);
+            f->changed = 0;
+            if (!pass(f, depth)) return 0;
+        }
+    } while (f->changed);
+    for (int ip = 0; ip < c->nins && !f->fail; ip++)
+        if (f->states[ip].seen) block(f, ip, 1);
+    return !f->fail && !f->changed;
+}
+
+// a callee's code up to its RET, checked to be straight line and to
+// leave depth values on the stack with its arguments included
+typedef struct {
+    ObjFunc *tmp;
+    Chunk *c;
+    int n;
+    int depth;
+} Body;
+
+// a function literal isn't copied, each evaluation of it has to give
+// the same function whether or not its call site was inlined
+static int copyable(Value v) {
+    if (v.type != V_OBJ) return 1;
+    return v.as.obj->type == OBJ_STR || v.as.obj->type == OBJ_NATIVE;
+}
+
+// constants belong to one chunk, an inlined body gets its own copy of
+// any string or template in it
+static Value copyval(Value v) {
+    if (v.type != V_OBJ) return v;
+    switch (v.as.obj->type) {
+    case OBJ_STR: return strval(((ObjString *)v.as.obj)->str);
+    case OBJ_TAB: return OBJVAL(copytemplate((ObjTab *)v.as.obj));
+    }
+    return v;
+}
+
+static int leafbody(Chunk *c, int arity, Body *b) {
+    Flow f = {.c = c};
+    f.stack = newarray(sizeof(Abs));
+    for (int k = 0; k < arity; k++) push(&f, unknown);
+    int ok = 0;
+    for (int ip = 0; ip < c->nins && ip <= MAXBODY && !f.fail; ip++) {
+        Ins i = c->ins[ip];
+        if (i.op == OP_RET) {
+            b->n = ip;
+            b->depth = f.depth;
+            ok = f.depth > arity;
+            break;
+        }
+        if (isjump(i.op) || i.op == OP_CALL || i.op == OP_GUARD
+                || i.op == OP_SLIDE || i.op == OP_GET_REG
+                || i.op == OP_SET_REG)
+            break;
+        if (i.op == OP_CONS && !copyable(c->cons[i.arg]))
+            break;
+        step(&f, ip);
+    }
+    freearray(f.stack);
+    return ok && !f.fail;
+}
+
+static int getbody(Value v, int nargs, Body *b) {
+    ObjFunc *fn = (ObjFunc *)v.as.obj;
+    memset(b, 0, sizeof(Body));
+    if (fn->arity != nargs) return 0;
+    if (fn->lazy) {
+        if (strlen(fn->lazy) > MAXLAZY) return 0;
+        // the copy's own call sites aren't counted, the function's are
+        // when its first call compiles it
+        OptStats saved = stats;
+        ErrJmp ej;
+        pusherr(&ej);
+        if (setjmp(ej.jb)) {
+            stats = saved;
+            return 0;
+        }
+        b->tmp = compilecopy(fn);
+        poperr(&ej);
+        stats = saved;
+    }
+    b->c = b->tmp ? b->tmp->chunk : fn->chunk;
+    if (leafbody(b->c, nargs, b)) return 1;
+    if (b->tmp) freefunc(b->tmp);
+    return 0;
+}
+
+// the callee's code with its locals moved up to base, then SLIDE drops
+// everything below its result down to and including the function
+static void emitbody(Chunk *c, Body *b, int base) {
+    for (int ip = 0; ip < b->n; ip++) {
+        Ins i = b->c->ins[ip];
+        switch (i.op) {
+        case OP_GET_LOCAL: case OP_SET_LOCAL:
+            i.arg += base;
+            break;
+        case OP_CONS: case OP_GET_FIELD: case OP_SET_FIELD:
+            i.arg = addcons(c, copyval(b->c->cons[i.arg]));
+            break;
+        case OP_NEW:
+            if (i.arg) i.arg = addcons(c, copyval(b->c->cons[i.arg - 1])) + 1;
+            break;
+        }
+        emit(c, i);
+    }
+    emitslide(c, b->depth);
+}
+
+typedef struct {
+    int call;
+    int guard;
+    Body body;
+} Site;
+
+// only the GET_FIELD at g and the CALL may touch the called value in
+// between, and nothing may jump in
+static int canguard(Flow *f, int g, int call) {
+    if (!f->fresh[g]) return 0;
+    for (int ip = g + 1; ip <= call; ip++) {
+        if (f->leader[ip]) return 0;
+        if (ip == call) break;
+        int op = f->c->ins[ip].op;
+        if (isjump(op) || op == OP_CALL || op == OP_RET || op == OP_GUARD)
+            return 0;
+    }
+    return 1;
+}
+
+static Site *findsites(Flow *f, int count, int *nsites) {
+    Chunk *c = f->c;
+    Site *sites = newarray(sizeof(Site));
+    int n = 0;
+    int *uses = xmalloc(c->nins * sizeof(int));
+    memset(uses, 0, c->nins * sizeof(int));
+    for (int ip = 0; ip < c->nins; ip++)
+        if (c->ins[ip].op == OP_CALL && f->callee[ip].kind == A_FIELD)
+            uses[f->callee[ip].ip]++;
+    for (int ip = 0; ip < c->nins; ip++) {
+        if (c->ins[ip].op != OP_CALL) continue;
+        if (count) stats.sites++;
+        Abs v = f->callee[ip];
+        Site s = {ip, -1};
+        if (v.kind == A_FIELD) {
+            if (uses[v.ip] != 1 || !canguard(f, v.ip, ip)) continue;
+            s.guard = v.ip;
+        }
+        else if (v.kind != A_FUNC) continue;
+        if (!getbody(c->cons[v.k], c->ins[ip].arg, &s.body)) continue;
+        sites = arraygrow(sites, n + 1);
+        sites[n++] = s;
+        stats.inlined++;
+        if (s.guard >= 0) stats.guarded++;
+    }
+    xfree(uses);
+    *nsites = n;
+    return sites;
+}
+
+typedef struct {
+    int at;
+    int to;
+} Fixup;
+
+// copies the instruction at ip into the new code, noting jumps to be
+// pointed at the new position of their target
+static void copyins(Chunk *c, Chunk *old, int ip, Fixup **fix, int *nfix) {
+    Ins i = old->ins[ip];
+    int at = emit(c, i);
+    if (isjump(i.op)) {
+        *fix = arraygrow(*fix, *nfix + 1);
+        (*fix)[(*nfix)++] = (Fixup){at, ip + i.arg};
+    }
+}
+
+static void rewrite(Chunk *c, Site *sites, int nsites, Flow *f) {
+    Chunk old = *c;
+    int *map = xmalloc((old.nins + 1) * sizeof(int));
+    Fixup *fix = newarray(sizeof(Fixup));
+    int nfix = 0;
+    c->ins = newarray(sizeof(Ins));
+    c->nins = 0;
+    Site *s = sites, *end = sites + nsites;
+    for (int ip = 0; ip < old.nins; ip++) {
+        map[ip] = c->nins;
+        if (s < end && s->guard == ip) {
+            // GET_FIELD; GUARD; JMP slow; args; body; JMP done;
+            // slow: args; CALL; done:
+            int nargs = old.ins[s->call].arg;
+            int base = f->calldepth[s->call] - nargs;
+            emit(c, old.ins[ip]);
+            emitguard(c, f->callee[s->call].k);
+            int slow = emitjmp(c);
+            for (int k = ip + 1; k < s->call; k++) emit(c, old.ins[k]);
+            emitbody(c, &s->body, base);
+            int done = emitjmp(c);
+            patchjmp(c, slow);
+            for (int k = ip + 1; k < s->call; k++) {
+                map[k] = c->nins;
+                emit(c, old.ins[k]);
+            }
+            map[s->call] = c->nins;
+            emit(c, old.ins[s->call]);
+            patchjmp(c, done);
+            ip = s->call;
+            s++;
+            continue;
+        }
+        if (s < end && s->call == ip) {
+            int nargs = old.ins[ip].arg;
+            emitbody(c, &s->body, f->calldepth[ip] - nargs);
+            s++;
+            continue;
+        }
+        copyins(c, &old, ip, &fix, &nfix);
+    }
+    map[old.nins] = c->nins;
+    for (int k = 0; k < nfix; k++)
+        c->ins[fix[k].at].arg = map[fix[k].to] - fix[k].at;
+    freearray(old.ins);
+    freearray(fix);
+    xfree(map);
+}
+
+// tables that don't escape are never made, their fields live in the
+// frame's registers and NEW leaves nil where the table would be. Sure
+// guards and the jumps they skip become NOPs. Instructions are replaced
+// one for one so no jump moves.
+static void scalar(Flow *f) {
+    Chunk *c = f->c;
+    char *gone = xmalloc(c->nins + 1);
+    memset(gone, 0, c->nins + 1);
+    for (int x = 0; x < c->nins; x++) {
+        Lit *l = &f->lits[x];
+        if (c->ins[x].op != OP_NEW || !l->parsed || !l->complete
+                || f->escaped[x] || c->nregs + l->nfields > MAXREGS)
+            continue;
+        for (int k = 0; k < l->nfields; k++) {
+            Field *fl = &l->fields[k];
+            for (int j = 0; j < k && fl->reg < 0; j++)
+                if (samestr(c->cons[l->fields[j].name], c->cons[fl->name]))
+                    fl->reg = l->fields[j].reg;
+            if (fl->reg < 0) fl->reg = c->nregs++;
+        }
+        gone[x] = 1;
+        stats.tables++;
+    }
+    for (int ip = 0; ip < c->nins; ip++) {
+        Ins *i = &c->ins[ip];
+        Abs t = f->recv[ip];
+        if (i->op == OP_NEW && gone[ip])
+            *i = (Ins){OP_NIL};
+        else if ((i->op == OP_GET_FIELD || i->op == OP_SET_FIELD)
+                && t.kind == A_TAB && gone[t.ip]) {
+            int reg = field(f, t.ip, i->arg)->reg;
+            *i = (Ins){i->op == OP_GET_FIELD ? OP_GET_REG : OP_SET_REG, reg};
+        }
+        else if (i->op == OP_GUARD && f->sure[ip]) {
+            i[0] = (Ins){OP_NOP};
+            i[1] = (Ins){OP_NOP};
+        }
+    }
+    xfree(gone);
+}
+
+static void initflow(Flow *f, Chunk *c, int keep) {
+    int n = c->nins + 1;
+    memset(f, 0, sizeof(Flow));
+    f->c = c;
+    f->nins = c->nins;
+    f->keep = keep;
+    f->leader = xmalloc(n);
+    memset(f->leader, 0, n);
+    f->fresh = xmalloc(n);
+    memset(f->fresh, 0, n);
+    f->sure = xmalloc(n);
+    memset(f->sure, 0, n);
+    f->escaped = xmalloc(n);
+    memset(f->escaped, 0, n);
+    f->written = xmalloc(n);
+    memset(f->written, 0, n);
+    f->init = xmalloc(n * sizeof(int));
+    memset(f->init, 0, n * sizeof(int));
+    f->lits = xmalloc(n * sizeof(Lit));
+    memset(f->lits, 0, n * sizeof(Lit));
+    f->states = xmalloc(n * sizeof(State));
+    memset(f->states, 0, n * sizeof(State));
+    f->recv = xmalloc(n * sizeof(Abs));
+    memset(f->recv, 0, n * sizeof(Abs));
+    f->callee = xmalloc(n * sizeof(Abs));
+    memset(f->callee, 0, n * sizeof(Abs));
+    f->calldepth = xmalloc(n * sizeof(int));
+    f->work = newarray(sizeof(int));
+    f->stack = newarray(sizeof(Abs));
+}
+
+// the chunk may have been rewritten since, the arrays are as long as
+// its code was
+static void freeflow(Flow *f) {
+    for (int ip = 0; ip < f->nins; ip++) {
+        if (f->states[ip].slots) xfree(f->states[ip].slots);
+        if (f->lits[ip].fields) freearray(f->lits[ip].fields);
+    }
+    xfree(f->leader);
+    xfree(f->fresh);
+    xfree(f->sure);
+    xfree(f->escaped);
+    xfree(f->written);
+    xfree(f->init);
+    xfree(f->lits);
+    xfree(f->states);
+    xfree(f->recv);
+    xfree(f->callee);
+    xfree(f->calldepth);
+    freearray(f->work);
+    freearray(f->stack);
+}
+
+void optimize(Chunk *c, int depth, int keep) {
+    int calls = 0, news = 0;
+    for (int ip = 0; ip < c->nins; ip++) {
+        calls += c->ins[ip].op == OP_CALL;
+        news += c->ins[ip].op == OP_NEW;
+    }
+    if (!optinline || (!calls && !news)) {
+        stats.sites += calls;
+        return;
+    }
+    for (int round = 0;; round++) {
+        Flow f;
+        initflow(&f, c, keep);
+        if (!analyse(&f, depth)) {
+            if (!round) stats.sites += calls;
+            freeflow(&f);
+            return;
+        }
+        int nsites = 0;
+        Site *sites = round < MAXROUNDS ? findsites(&f, !round, &nsites) : 0;
+        if (nsites) rewrite(c, sites, nsites, &f);
+        for (int k = 0; k < nsites; k++)
+            if (sites[k].body.tmp) freefunc(sites[k].body.tmp);
+        if (sites) freearray(sites);
+        if (!nsites) scalar(&f);
+        freeflow(&f);
+        if (!nsites) return;
+    }
+}
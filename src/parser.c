@@ -1,10 +1,13 @@
-#include <ctype.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <star/mem.h>
 #include <star/util.h>
 #include <star/star.h>
+#include <star/scan.h>
+#include <star/opt.h>
 
 #define TOKS(T) T(NONE) T(EOF) T(NUM) T(NIL) T(STR) \
         T(ADD) T(SUB) T(MUL) T(DIV) \
@@ -12,9 +15,11 @@
         T(COMMA) \
         T(LPAREN) T(RPAREN) \
         T(LBRACE) T(RBRACE) \
+        T(LBRACKET) T(RBRACKET) \
+        T(HASH) \
         T(ASSIGN) \
         T(ID) \
-        T(VAR) T(PRINT) T(IF) T(ELSE) T(WHILE) T(FUNC) \
+        T(VAR) T(PRINT) T(DELETE) T(IF) T(ELSE) T(WHILE) T(FUNC) T(FOR) T(IN) \
         T(LT) T(GT) T(EQ) T(NEQ) T(LTE) T(GTE) T(BANG) T(AND) T(OR) \
         T(TRUE) T(FALSE) \
         T(COLON) \
@@ -26,35 +31,67 @@ enum {
 #undef T
 };
 
+// numbers aren't interned, the lexer parses them into num
 typedef struct {
     char type;
     char *_start;
     int len;
     char *str;
+    double num;
 } Tok;
 
+// shadow is the local the same name referred to before this one
 typedef struct {
     Tok name;
     int depth;
+    int shadow;
 } Local;
 
+// the innermost local an interned name refers to, -1 for none
+typedef struct {
+    char *name;
+    int top;
+} Bind;
+
 typedef struct Function Function;
 struct Function {
     ObjFunc *obj;
     Local *locals;
     int nlocals;
     int depth;
+    Bind *binds;
+    int nbinds;
+    int bindcap;
     Function *parent;
 };
 
+// interned token strings, type is the keyword's token type or T_ID
+typedef struct {
+    char *str;
+    int len;
+    unsigned hash;
+    char type;
+} Sym;
+
+// src and end bound the input, or for a stream what's buffered of it.
+// A stream keeps everything from mark on while it's set
 typedef struct {
     char *src;
+    char *end;
+    char *tok;
+    char *mark;
+    FILE *fp;
+    char *buf;
+    int cap;
     Tok prev;
     Tok next;
-    Tab *kws;
-    char **tokstrs;
-    int ntokstrs;
+    Sym *syms;
+    int nsyms;
+    int symcap;
     Function *func;
+    char *fnname;
+    Chunk *joinchunk;
+    int join;
 } Parser;
 
 static const char *tname(int type) {
@@ -63,112 +100,240 @@ static const char *tname(int type) {
     TOKS(T)
 #undef T
     }
-    printf("*** unknown token type %i\n", type);
-    exit(1);
+    starfail("unknown token type %i", type);
+}
+
+// streams keep only the token being lexed and what comes after it, the
+// window grows only when a single token doesn't fit
+static int refill(Parser *p) {
+    if (!p->fp) return 0;
+    char *from = p->mark ? p->mark : p->tok;
+    int keep = p->end - from;
+    int tok = p->tok - from;
+    int src = p->src - from;
+    if (keep == p->cap) {
+        int off = from - p->buf;
+        p->cap *= 2;
+        p->buf = xrealloc(p->buf, p->cap);
+        from = p->buf + off;
+    }
+    memmove(p->buf, from, keep);
+    if (p->mark) p->mark = p->buf;
+    p->tok = p->buf + tok;
+    p->src = p->buf + src;
+    int n = fread(p->buf + keep, 1, p->cap - keep, p->fp);
+    p->end = p->buf + keep + n;
+    return n > 0;
+}
+
+// the char off bytes past src, -1 past the end of the input
+static int peekc(Parser *p, int off) {
+    while (p->src + off >= p->end)
+        if (!refill(p)) return -1;
+    return (unsigned char)p->src[off];
+}
+
+// runs skip across refills, and whitespace is dropped from the window
+static void scan(Parser *p, char *(*skip)(char *, char *)) {
+    while ((p->src = skip(p->src, p->end)) == p->end && refill(p));
+}
+
+static void scanspace(Parser *p) {
+    for (;;) {
+        p->tok = p->src = skipspace(p->src, p->end);
+        if (p->src < p->end || !refill(p)) return;
+    }
+}
+
+static const double POW10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+// digits with at most one dot. When the digits and the power of ten are
+// both exact doubles the one division rounds correctly, anything longer
+// goes through strtod
+static double parsenum(char *s, int len) {
+    uint64_t mant = 0;
+    int ndigits = 0, nfrac = 0, frac = 0;
+    for (int i = 0; i < len; i++) {
+        if (s[i] == '.') {
+            frac = 1;
+            continue;
+        }
+        mant = mant * 10 + (s[i] - '0');
+        ndigits++;
+        nfrac += frac;
+    }
+    if (ndigits <= 19 && mant <= 1ull << 53 && nfrac <= 22)
+        return (double)mant / POW10[nfrac];
+    char buf[64];
+    char *str = len < sizeof(buf) ? buf : xmalloc(len + 1);
+    memcpy(str, s, len);
+    str[len] = 0;
+    double num = strtod(str, 0);
+    if (str != buf) xfree(str);
+    return num;
+}
+
+static Tok tok(Parser *p, int type, int len) {
+    p->src += len;
+    return (Tok){type, p->tok, len};
 }
 
 static Tok nexttok(Parser *p) {
-    char *start;
-    while (isspace(*p->src))
-        p->src++;
-    start = p->src;
-    switch (*start) {
-    case 0: return (Tok){T_EOF};
-    case '+': p->src++; return (Tok){T_ADD, start, 1};
-    case '-': p->src++; return (Tok){T_SUB, start, 1};
-    case '*': p->src++; return (Tok){T_MUL, start, 1};
-    case '/': p->src++; return (Tok){T_DIV, start, 1};
-    case '(': p->src++; return (Tok){T_LPAREN, start, 1};
-    case ')': p->src++; return (Tok){T_RPAREN, start, 1};
-    case '{': p->src++; return (Tok){T_LBRACE, start, 1};
-    case '}': p->src++; return (Tok){T_RBRACE, start, 1};
+    scanspace(p);
+    int c = peekc(p, 0);
+    switch (c) {
+    case -1: return (Tok){T_EOF};
+    case '+': return tok(p, T_ADD, 1);
+    case '-': return tok(p, T_SUB, 1);
+    case '*': return tok(p, T_MUL, 1);
+    case '/': return tok(p, T_DIV, 1);
+    case '(': return tok(p, T_LPAREN, 1);
+    case ')': return tok(p, T_RPAREN, 1);
+    case '{': return tok(p, T_LBRACE, 1);
+    case '}': return tok(p, T_RBRACE, 1);
+    case '[': return tok(p, T_LBRACKET, 1);
+    case ']': return tok(p, T_RBRACKET, 1);
+    case '#': return tok(p, T_HASH, 1);
     case '&':
-        if (*(p->src + 1) != '&') break;
-        p->src += 2;
-        return (Tok){T_AND, start, 2};
+        if (peekc(p, 1) != '&') break;
+        return tok(p, T_AND, 2);
     case '|':
-        if (*(p->src + 1) != '|') break;
-        p->src += 2;
-        return (Tok){T_OR, start, 2};
+        if (peekc(p, 1) != '|') break;
+        return tok(p, T_OR, 2);
     case '!':
-        p->src++;
-        if (*p->src != '=')
-            return (Tok){T_BANG, start, 1};
-        p->src++;
-        return (Tok){T_NEQ, start, 2};
+        if (peekc(p, 1) != '=')
+            return tok(p, T_BANG, 1);
+        return tok(p, T_NEQ, 2);
     case '=':
-        p->src++;
-        if (*p->src != '=')
-            return (Tok){T_ASSIGN, start, 1};
-        p->src++;
-        return (Tok){T_EQ, start, 2};
+        if (peekc(p, 1) != '=')
+            return tok(p, T_ASSIGN, 1);
+        return tok(p, T_EQ, 2);
     case '<':
-        p->src++;
-        if (*p->src != '=')
-            return (Tok){T_LT, start, 1};
-        p->src++;
-        return (Tok){T_LTE, start, 2};
+        if (peekc(p, 1) != '=')
+            return tok(p, T_LT, 1);
+        return tok(p, T_LTE, 2);
     case '>':
-        p->src++;
-        if (*p->src != '=')
-            return (Tok){T_GT, start, 1};
-        p->src++;
-        return (Tok){T_GTE, start, 2};
-    case '.': p->src++; return (Tok){T_DOT, start, 1};
-    case ':': p->src++; return (Tok){T_COLON, start, 1};
-    case ',': p->src++; return (Tok){T_COMMA, start, 1};
+        if (peekc(p, 1) != '=')
+            return tok(p, T_GT, 1);
+        return tok(p, T_GTE, 2);
+    case '.': return tok(p, T_DOT, 1);
+    case ':': return tok(p, T_COLON, 1);
+    case ',': return tok(p, T_COMMA, 1);
     case '"': p->src++; goto str;
     }
-    if (isdigit(*start)) goto num;
-    if (isalpha(*start) || *start == '_') goto id;
-    printf("*** unexpected char %c\n", *start);
-    exit(1);
+    if (CCLASS[c] & C_DIGIT) goto num;
+    if (CCLASS[c] & C_ALPHA) goto id;
+    starfail("unexpected char %c", c);
 num:
-    while (isdigit(*p->src))
+    scan(p, skipdigits);
+    if (peekc(p, 0) == '.' && peekc(p, 1) != -1 && CCLASS[peekc(p, 1)] & C_DIGIT) {
         p->src++;
-    return (Tok){T_NUM, start, p->src - start};
+        scan(p, skipdigits);
+    }
+    Tok t = {T_NUM, p->tok, p->src - p->tok};
+    t.num = parsenum(t._start, t.len);
+    return t;
 id:
-    while (isalnum(*p->src) || *p->src == '_')
-        p->src++;
-    return (Tok){T_ID, start, p->src - start};
+    scan(p, skipident);
+    return (Tok){T_ID, p->tok, p->src - p->tok};
 str:
-    while (*p->src && *p->src != '"')
-        p->src++;
-    if (!*p->src) {
-        printf("*** untermianted string\n");
-        exit(1);
-    }
+    scan(p, findquote);
+    if (p->src == p->end)
+        starfail("untermianted string");
     p->src++;
-    return (Tok){T_STR, start + 1, p->src - start - 2};
+    return (Tok){T_STR, p->tok + 1, p->src - p->tok - 2};
+}
+
+static int kw(char *s, int len, char *word, int type) {
+    if (len != strlen(word) || memcmp(s, word, len) != 0) return T_ID;
+    return type;
+}
+
+static int keyword(char *s, int len) {
+    switch (*s) {
+    case 'd': return kw(s, len, "delete", T_DELETE);
+    case 'e': return kw(s, len, "else", T_ELSE);
+    case 'f':
+        if (len > 1 && s[1] == 'a') return kw(s, len, "false", T_FALSE);
+        if (len > 1 && s[1] == 'o') return kw(s, len, "for", T_FOR);
+        return kw(s, len, "function", T_FUNC);
+    case 'i':
+        if (len > 1 && s[1] == 'n') return kw(s, len, "in", T_IN);
+        return kw(s, len, "if", T_IF);
+    case 'n': return kw(s, len, "nil", T_NIL);
+    case 'p': return kw(s, len, "print", T_PRINT);
+    case 'r': return kw(s, len, "return", T_RET);
+    case 't': return kw(s, len, "true", T_TRUE);
+    case 'v': return kw(s, len, "var", T_VAR);
+    case 'w': return kw(s, len, "while", T_WHILE);
+    }
+    return T_ID;
+}
+
+static Sym *allocsyms(int n) {
+    Sym *syms = xmalloc(n * sizeof(Sym));
+    memset(syms, 0, n * sizeof(Sym));
+    return syms;
+}
+
+static Sym *findsym(Sym *syms, int cap, char *str, int len, unsigned hash) {
+    unsigned i = hash & (cap - 1);
+    for (;; i = (i + 1) & (cap - 1)) {
+        Sym *sym = &syms[i];
+        if (!sym->str) return sym;
+        if (sym->hash == hash && sym->len == len
+                && memcmp(sym->str, str, len) == 0)
+            return sym;
+    }
+}
+
+static void growsyms(Parser *p) {
+    int cap = p->symcap * 2;
+    Sym *syms = allocsyms(cap);
+    for (int i = 0; i < p->symcap; i++) {
+        Sym *sym = &p->syms[i];
+        if (sym->str) *findsym(syms, cap, sym->str, sym->len, sym->hash) = *sym;
+    }
+    xfree(p->syms);
+    p->syms = syms;
+    p->symcap = cap;
+}
+
+// the returned symbol moves when the next new string is interned
+static Sym *internstr(Parser *p, char *str, int len) {
+    if ((p->nsyms + 1) * 4 > p->symcap * 3) growsyms(p);
+    unsigned hash = strhashn(str, len);
+    Sym *sym = findsym(p->syms, p->symcap, str, len, hash);
+    if (sym->str) return sym;
+    sym->str = xmalloc(len + 1);
+    memcpy(sym->str, str, len);
+    sym->str[len] = 0;
+    sym->len = len;
+    sym->hash = hash;
+    sym->type = len ? keyword(str, len) : T_ID;
+    p->nsyms++;
+    return sym;
 }
 
 static void intern(Parser *p, Tok *t) {
-    if (!t->len) t->_start = "";
-    for (int i = 0; i < p->ntokstrs; i++) {
-        char *str = p->tokstrs[i];
-        if (strlen(str) != t->len) continue;
-        if (strncmp(str, t->_start, t->len) != 0) continue;
-        t->str = str;
+    if (t->type == T_NUM) {
         t->_start = 0;
         return;
     }
-    t->str = xmalloc(t->len + 1);
-    memcpy(t->str, t->_start, t->len);
-    t->str[t->len] = 0;
+    if (!t->len) t->_start = "";
+    Sym *sym = internstr(p, t->_start, t->len);
+    t->str = sym->str;
     t->_start = 0;
-    p->ntokstrs++;
-    p->tokstrs = arraygrow(p->tokstrs, p->ntokstrs);
-    p->tokstrs[p->ntokstrs - 1] = t->str;
-    // printf("new str %s\n", t->str);
-
+    if (t->type == T_ID) t->type = sym->type;
 }
 
 static void advance(Parser *p) {
     p->prev = p->next;
     p->next = nexttok(p);
     intern(p, &p->next);
-    if (p->next.type == T_ID && tabhas(p->kws, p->next.str))
-        p->next.type = tabget(p->kws, p->next.str);
 }
 
 static int match(Parser *p, int type) {
@@ -177,51 +342,107 @@ static int match(Parser *p, int type) {
     return 1;
 }
 
+static char *tokstr(Tok *t, char *buf) {
+    if (t->type != T_NUM) return t->str;
+    sprintf(buf, "%g", t->num);
+    return buf;
+}
+
 static void expect(Parser *p, int type) {
     if (match(p, type)) return;
-    printf("*** expected %s got %s:%s\n",
-            tname(type), tname(p->next.type), p->next.str);
-    exit(1);
+    char buf[32];
+    starfail("expected %s got %s:%s",
+            tname(type), tname(p->next.type), tokstr(&p->next, buf));
 }
 
 static Chunk *curchunk(Parser *p) {
     return p->func->obj->chunk;
 }
 
+static unsigned ptrhash(char *name) {
+    return (unsigned)((uintptr_t)name >> 4) * 2654435761u;
+}
+
+// names are interned so comparing pointers is enough
+static Bind *findbind(Bind *binds, int cap, char *name) {
+    unsigned i = ptrhash(name) & (cap - 1);
+    while (binds[i].name && binds[i].name != name)
+        i = (i + 1) & (cap - 1);
+    return &binds[i];
+}
+
+static Bind *allocbinds(int n) {
+    Bind *binds = xmalloc(n * sizeof(Bind));
+    memset(binds, 0, n * sizeof(Bind));
+    return binds;
+}
+
+static Bind *bind(Function *fn, char *name) {
+    Bind *b = findbind(fn->binds, fn->bindcap, name);
+    if (b->name) return b;
+    if ((fn->nbinds + 1) * 4 > fn->bindcap * 3) {
+        int cap = fn->bindcap * 2;
+        Bind *binds = allocbinds(cap);
+        for (int i = 0; i < fn->bindcap; i++)
+            if (fn->binds[i].name)
+                *findbind(binds, cap, fn->binds[i].name) = fn->binds[i];
+        xfree(fn->binds);
+        fn->binds = binds;
+        fn->bindcap = cap;
+        b = findbind(fn->binds, fn->bindcap, name);
+    }
+    fn->nbinds++;
+    b->name = name;
+    b->top = -1;
+    return b;
+}
+
+// only the innermost local of a name is visible, and locals are declared
+// in order of depth, so it's the only one that needs checking
 static int getlocal(Parser *p, Tok name, int depth) {
     Function *fn = p->func;
-    for (int i = fn->nlocals - 1; i >= 0; i--) {
-        Local *l = &fn->locals[i];
-        if (l->depth < depth) return -1;
-        if (strcmp(l->name.str, name.str) != 0) continue;
-        return i;
-    }
-    return -1;
+    Bind *b = findbind(fn->binds, fn->bindcap, name.str);
+    if (!b->name || b->top == -1) return -1;
+    if (fn->locals[b->top].depth < depth) return -1;
+    return b->top;
 }
 
 static int haslocal(Parser *p, Tok name) {
     return getlocal(p, name, p->func->depth) != -1;
 }
 
+// locals hide natives, a native is a constant like any other
 static void resolve(Parser *p, Tok name) {
     int slot = getlocal(p, name, 0);
-    if (slot == -1) {
-        printf("*** undeclared identifier %s\n", name.str);
-        exit(1);
+    if (slot != -1) {
+        emitgetlocal(curchunk(p), slot);
+        return;
     }
-    emitgetlocal(curchunk(p), slot);
+    ObjNative *n = findnative(name.str);
+    if (!n)
+        starfail("undeclared identifier %s", name.str);
+    emitcons(curchunk(p), addcons(curchunk(p), OBJVAL(n)));
 }
 
 static void expr(Parser *p);
 
+// the keys are all known here, they go in a template that NEW copies
 static void object(Parser *p) {
-    emitnew(curchunk(p));
+    if (match(p, T_RBRACE)) {
+        emitnew(curchunk(p), 0);
+        return;
+    }
+    ObjTab *tmpl = newtemplate();
+    emitnew(curchunk(p), addcons(curchunk(p), OBJVAL(tmpl)) + 1);
     while (!match(p, T_RBRACE)) {
         expect(p, T_DOT);
         expect(p, T_ID);
         int fieldname = addcons(curchunk(p), strval(p->prev.str));
+        char *name = p->prev.str;
+        addtemplatekey(tmpl, name);
         expect(p, T_ASSIGN);
         emitdup(curchunk(p));
+        if (p->next.type == T_FUNC) p->fnname = name;
         expr(p);
         emitsetfield(curchunk(p), fieldname);
         emitpop(curchunk(p)); // set_field pushes the value
@@ -235,10 +456,88 @@ static void definelocal(Parser *p, Tok name) {
     fn->locals = arraygrow(fn->locals, fn->nlocals);
     fn->locals[idx].name = name;
     fn->locals[idx].depth = p->func->depth;
+    Bind *b = bind(fn, name.str);
+    fn->locals[idx].shadow = b->top;
+    b->top = idx;
+}
+
+static void poplocal(Parser *p) {
+    Function *fn = p->func;
+    Local *l = &fn->locals[--fn->nlocals];
+    findbind(fn->binds, fn->bindcap, l->name.str)->top = l->shadow;
 }
 
 static void stm(Parser *p);
 
+// functions being compiled live on the heap so an error can free them
+static void beginfunc(Parser *p, char *name) {
+    Function *fn = xmalloc(sizeof(Function));
+    memset(fn, 0, sizeof(Function));
+    fn->obj = newfunc();
+    fn->locals = newarray(sizeof(Local));
+    fn->bindcap = 8;
+    fn->binds = allocbinds(fn->bindcap);
+    fn->parent = p->func;
+    setname(fn->obj->chunk, name);
+    p->func = fn;
+}
+
+static ObjFunc *endfunc(Parser *p) {
+    Function *fn = p->func;
+    ObjFunc *obj = fn->obj;
+    p->func = fn->parent;
+    freearray(fn->locals);
+    xfree(fn->binds);
+    xfree(fn);
+    return obj;
+}
+
+static void params(Parser *p) {
+    expect(p, T_LPAREN);
+    int nparams = 0;
+    while (!match(p, T_RPAREN)) {
+        expect(p, T_ID);
+        Tok name = p->prev;
+        if (haslocal(p, name))
+            starfail("parameter %s already declared", name.str);
+        definelocal(p, name);
+        nparams++;
+        match(p, T_COMMA); // optional
+    }
+    p->func->obj->arity = nparams;
+}
+
+// a block body is only lexed to find its end, it's kept as source along
+// with the parameters and compiled by its first call
+static void skim(Parser *p) {
+    Function *fn = p->func;
+    int len = 2;
+    for (int i = 0; i < fn->nlocals; i++)
+        len += fn->locals[i].name.len + 1;
+    p->mark = p->tok;
+    for (int depth = 0;; advance(p)) {
+        if (p->next.type == T_EOF)
+            starfail("expected RBRACE got EOF");
+        if (p->next.type == T_LBRACE) depth++;
+        if (p->next.type == T_RBRACE && --depth == 0) break;
+    }
+    int body = p->src - p->mark;
+    char *lazy = xmalloc(len + body + 1);
+    char *s = lazy;
+    *s++ = '(';
+    for (int i = 0; i < fn->nlocals; i++) {
+        memcpy(s, fn->locals[i].name.str, fn->locals[i].name.len);
+        s += fn->locals[i].name.len;
+        *s++ = ' ';
+    }
+    *s++ = ')';
+    memcpy(s, p->mark, body);
+    s[body] = 0;
+    fn->obj->lazy = lazy;
+    p->mark = 0;
+    advance(p);
+}
+
 static void primary(Parser *p) {
     if (match(p, T_STR)) {
         emitcons(curchunk(p), addcons(curchunk(p), strval(p->prev.str)));
@@ -253,7 +552,7 @@ static void primary(Parser *p) {
         emitnil(curchunk(p));
     }
     else if (match(p, T_NUM)) {
-        emitcons(curchunk(p), addcons(curchunk(p), numval(atof(p->prev.str))));
+        emitcons(curchunk(p), addcons(curchunk(p), numval(p->prev.num)));
     }
     else if (match(p, T_ID)) {
         resolve(p, p->prev);
@@ -265,44 +564,54 @@ static void primary(Parser *p) {
     else if (match(p, T_LBRACE)) {
         object(p);
     }
-    else if (match(p, T_FUNC)) {
-        Function child = {0};
-        child.obj = newfunc();
-        child.locals = newarray(sizeof(Local));
-        child.parent = p->func;
-        p->func = &child;
-        expect(p, T_LPAREN);
-        int nparams = 0;
-        while (!match(p, T_RPAREN)) {
-            expect(p, T_ID);
-            Tok name = p->prev;
-            if (haslocal(p, name)) {
-                printf("*** parameter %s already declared\n", name.str);
-                exit(1);
+    else if (match(p, T_LBRACKET)) {
+        int n = 0;
+        // unlike elsewhere commas are needed, [a (b)] would be a call
+        while (!match(p, T_RBRACKET)) {
+            expr(p);
+            n++;
+            if (!match(p, T_COMMA)) {
+                expect(p, T_RBRACKET);
+                break;
             }
-            definelocal(p, name);
-            nparams++;
-            match(p, T_COMMA); // optional
         }
-        p->func->obj->arity = nparams;
-        stm(p);
-        emitnil(curchunk(p));
-        emitret(curchunk(p));
-        printchunk(curchunk(p));
-        p->func = p->func->parent;
-        emitcons(curchunk(p), addcons(curchunk(p), OBJVAL(child.obj)));
+        emitarr(curchunk(p), n);
+    }
+    else if (match(p, T_FUNC)) {
+        beginfunc(p, p->fnname ? p->fnname : "function");
+        p->fnname = 0;
+        params(p);
+        if (p->next.type == T_LBRACE) {
+            skim(p);
+        }
+        else {
+            stm(p);
+            emitnil(curchunk(p));
+            emitret(curchunk(p));
+            optimize(curchunk(p), p->func->obj->arity, 0);
+        }
+        ObjFunc *fn = endfunc(p);
+        emitcons(curchunk(p), addcons(curchunk(p), OBJVAL(fn)));
     }
     else {
-        printf("*** unexpected token %s:%s\n", tname(p->next.type), p->next.str);
-        exit(1);
+        char buf[32];
+        starfail("unexpected token %s:%s",
+                tname(p->next.type), tokstr(&p->next, buf));
     }
 }
 
 static void calldotexpr(Parser *p) {
     primary(p);
     int colon = 0;
-    while (match(p, T_LPAREN) || match(p, T_DOT) || match(p, T_COLON)) {
-        if (p->prev.type == T_LPAREN) {
+    while (match(p, T_LPAREN) || match(p, T_DOT) || match(p, T_COLON)
+            || match(p, T_LBRACKET)) {
+        if (p->prev.type == T_LBRACKET) {
+            if (colon) goto end;
+            expr(p);
+            expect(p, T_RBRACKET);
+            emitgetindex(curchunk(p));
+        }
+        else if (p->prev.type == T_LPAREN) {
             int nargs = 0;
             if (colon) {
                 colon = 0;
@@ -329,10 +638,8 @@ static void calldotexpr(Parser *p) {
         }
     }
 end:
-    if (colon) {
-        printf("*** colon has to be followed by function call\n");
-        exit(1);
-    }
+    if (colon)
+        starfail("colon has to be followed by function call");
 }
 
 static void unary(Parser *p) {
@@ -340,10 +647,14 @@ static void unary(Parser *p) {
         unary(p);
         emitneg(curchunk(p));
     }
-    if (match(p, T_BANG)) {
+    else if (match(p, T_BANG)) {
         unary(p);
         emitnot(curchunk(p));
     }
+    else if (match(p, T_HASH)) {
+        unary(p);
+        emitlen(curchunk(p));
+    }
     else {
         calldotexpr(p);
     }
@@ -409,25 +720,44 @@ static void eqexpr(Parser *p) {
     }
 }
 
+// the ip a short-circuit's jump lands on is remembered, an lvalue
+// can't end there: the jump would skip it with the left operand
+// still on the stack
+static void patchjoin(Parser *p, int skip) {
+    patchjmp(curchunk(p), skip);
+    p->joinchunk = curchunk(p);
+    p->join = getip(curchunk(p));
+}
+
+static int joined(Parser *p, int ip) {
+    return p->joinchunk == curchunk(p) && p->join == ip;
+}
+
+// the right operand is skipped once the left one decides, the
+// result is whichever operand was evaluated last
 static void andexpr(Parser *p) {
     eqexpr(p);
     while (match(p, T_AND)) {
+        int skip = emitand(curchunk(p));
         eqexpr(p);
-        emitand(curchunk(p));
+        patchjoin(p, skip);
     }
 }
 
 static void orexpr(Parser *p) {
     andexpr(p);
     while (match(p, T_OR)) {
+        int skip = emitor(curchunk(p));
         andexpr(p);
-        emitor(curchunk(p));
+        patchjoin(p, skip);
     }
 }
 
 static void assignment(Parser *p) {
     orexpr(p);
     if (match(p, T_ASSIGN)) {
+        if (joined(p, getip(curchunk(p))))
+            starfail("left-hand side not an lvalue");
         int getop = getip(curchunk(p)) - 1;
         assignment(p);
         fixassign(curchunk(p), getop);
@@ -447,7 +777,7 @@ static void block(Parser *p) {
         stm(p);
     p->func->depth--;
     while (p->func->nlocals > nlocals) {
-        p->func->nlocals--;
+        poplocal(p);
         emitpop(curchunk(p));
     }
 }
@@ -478,6 +808,45 @@ static void whilestm(Parser *p) {
     patchjmp(curchunk(p), endjmp);
 }
 
+static void definehidden(Parser *p, char *name) {
+    Sym *sym = internstr(p, name, strlen(name));
+    definelocal(p, (Tok){T_ID, 0, sym->len, sym->str});
+}
+
+// the array, the position in it and the variable are locals of the
+// loop, on top of the stack whenever ITER runs
+static void forstm(Parser *p) {
+    int nlocals = p->func->nlocals;
+    p->func->depth++;
+    expect(p, T_LPAREN);
+    expect(p, T_ID);
+    Tok name = p->prev;
+    expect(p, T_IN);
+    expr(p);
+    expect(p, T_RPAREN);
+    definehidden(p, "(array)");
+    emitcons(curchunk(p), addcons(curchunk(p), numval(0)));
+    definehidden(p, "(index)");
+    emitnil(curchunk(p));
+    definelocal(p, name);
+    int ip = getip(curchunk(p));
+    int endjmp = emititer(curchunk(p));
+    int nloop = p->func->nlocals;
+    stm(p);
+    // a bare var as the body mustn't pile up on the loop's locals
+    while (p->func->nlocals > nloop) {
+        poplocal(p);
+        emitpop(curchunk(p));
+    }
+    emitjmp2(curchunk(p), ip - getip(curchunk(p)));
+    patchjmp(curchunk(p), endjmp);
+    p->func->depth--;
+    while (p->func->nlocals > nlocals) {
+        poplocal(p);
+        emitpop(curchunk(p));
+    }
+}
+
 static void stm(Parser *p) {
     if (match(p, T_RET)) {
         expr(p);
@@ -489,18 +858,21 @@ static void stm(Parser *p) {
     else if (match(p, T_WHILE)) {
         whilestm(p);
     }
+    else if (match(p, T_FOR)) {
+        forstm(p);
+    }
     else if (match(p, T_LBRACE)) {
         block(p);
     }
     else if (match(p, T_VAR)) {
         expect(p, T_ID);
         Tok name = p->prev;
-        if (haslocal(p, name)) {
-            printf("*** variable %s already declared\n", name.str);
-            exit(1);
-        }
-        if (match(p, T_ASSIGN))
+        if (haslocal(p, name))
+            starfail("variable %s already declared", name.str);
+        if (match(p, T_ASSIGN)) {
+            if (p->next.type == T_FUNC) p->fnname = name.str;
             expr(p);
+        }
         else
             emitnil(curchunk(p));
         definelocal(p, name);
@@ -509,49 +881,186 @@ static void stm(Parser *p) {
         expr(p);
         emitprint(curchunk(p));
     }
+    else if (match(p, T_DELETE)) {
+        expr(p);
+        if (joined(p, getip(curchunk(p))))
+            starfail("can only delete fields and indexes");
+        fixdelete(curchunk(p), getip(curchunk(p)) - 1);
+    }
     else {
         expr(p);
         emitpop(curchunk(p));
     }
 }
 
-static ObjFunc *parsefile(Parser *p) {
-    Function main = {0};
-    main.obj = newfunc();
-    main.locals = newarray(sizeof(Local));
-    p->func = &main;
+static ObjFunc *parsefile(Parser *p, Scope *scope, int keep) {
+    beginfunc(p, "main");
+    for (int i = 0; scope && i < scope->nnames; i++) {
+        Sym *sym = internstr(p, scope->names[i], strlen(scope->names[i]));
+        definelocal(p, (Tok){T_ID, 0, sym->len, sym->str});
+    }
     advance(p);
     while (!match(p, T_EOF))
         stm(p);
-    while (main.nlocals--)
-        emitpop(curchunk(p));
+    if (keep && scope) {
+        for (int i = scope->nnames; i < p->func->nlocals; i++)
+            scopeadd(scope, p->func->locals[i].name.str);
+    }
+    else {
+        while (p->func->nlocals--)
+            emitpop(curchunk(p));
+    }
     emitret(curchunk(p));
-    return main.obj;
+    optimize(curchunk(p), scope ? scope->nnames : 0, keep);
+    return endfunc(p);
 }
 
-static void definekws(Parser *p) {
-    tabset(p->kws, "var", T_VAR);
-    tabset(p->kws, "print", T_PRINT);
-    tabset(p->kws, "if", T_IF);
-    tabset(p->kws, "else", T_ELSE);
-    tabset(p->kws, "while", T_WHILE);
-    tabset(p->kws, "nil", T_NIL);
-    tabset(p->kws, "function", T_FUNC);
-    tabset(p->kws, "return", T_RET);
-    tabset(p->kws, "true", T_TRUE);
-    tabset(p->kws, "false", T_FALSE);
+static ObjFunc *parsebody(Parser *p) {
+    beginfunc(p, "function");
+    advance(p);
+    params(p);
+    stm(p);
+    expect(p, T_EOF);
+    emitnil(curchunk(p));
+    emitret(curchunk(p));
+    optimize(curchunk(p), p->func->obj->arity, 0);
+    return endfunc(p);
 }
 
-ObjFunc *compile(char *src) {
-    Parser p = {0};
-    p.src = src;
-    p.kws = newtab();
-    p.tokstrs = newarray(sizeof(char *));
-    definekws(&p);
-    ObjFunc *func = parsefile(&p);
-    freetab(p.kws);
-    for (int i = 0; i < p.ntokstrs; i++)
-        xfree(p.tokstrs[i]);
-    freearray(p.tokstrs);
+#define WINDOW (64 * 1024)
+
+static void initparser(Parser *p, char *src, size_t len, FILE *fp) {
+    memset(p, 0, sizeof(Parser));
+    p->src = p->end = p->tok = src;
+    if (src) p->end += len;
+    if (fp) {
+        p->fp = fp;
+        p->cap = WINDOW;
+        p->src = p->end = p->tok = p->buf = xmalloc(p->cap);
+    }
+    p->symcap = 64;
+    p->syms = allocsyms(p->symcap);
+}
+
+static void freeparser(Parser *p) {
+    if (p->buf) xfree(p->buf);
+    for (int i = 0; i < p->symcap; i++)
+        if (p->syms[i].str) xfree(p->syms[i].str);
+    xfree(p->syms);
+}
+
+Scope *newscope() {
+    Scope *s = xmalloc(sizeof(Scope));
+    s->names = newarray(sizeof(char *));
+    s->nnames = 0;
+    return s;
+}
+
+void freescope(Scope *s) {
+    for (int i = 0; i < s->nnames; i++)
+        xfree(s->names[i]);
+    freearray(s->names);
+    xfree(s);
+}
+
+void scopeadd(Scope *s, char *name) {
+    int idx = s->nnames++;
+    s->names = arraygrow(s->names, s->nnames);
+    s->names[idx] = xmalloc(strlen(name) + 1);
+    strcpy(s->names[idx], name);
+}
+
+// on error everything compiled so far is freed and the error passed on,
+// the scope is only added to once the whole script has compiled
+static ObjFunc *compileinput(char *src, size_t len, FILE *fp, Scope *scope,
+        int keep, int body) {
+    Parser *p = xmalloc(sizeof(Parser));
+    ErrJmp ej;
+    initparser(p, src, len, fp);
+    pusherr(&ej);
+    if (setjmp(ej.jb)) {
+        while (p->func)
+            freefunc(endfunc(p));
+        freeparser(p);
+        xfree(p);
+        starfail("%s", ej.msg);
+    }
+    ObjFunc *func = body ? parsebody(p) : parsefile(p, scope, keep);
+    poperr(&ej);
+    freeparser(p);
+    xfree(p);
     return func;
 }
+
+ObjFunc *compilen(char *src, size_t len, Scope *scope, int keep) {
+    return compileinput(src, len, 0, scope, keep, 0);
+}
+
+// reads fp a window at a time, the source is never in memory as a whole
+ObjFunc *compilefp(FILE *fp, Scope *scope, int keep) {
+    return compileinput(0, 0, fp, scope, keep, 0);
+}
+
+static pthread_mutex_t lazylock = PTHREAD_MUTEX_INITIALIZER;
+
+// the body goes into a function of its own first so a compile error
+// leaves fn as it was, and fn->lazy is only cleared once its chunk is
+// complete. Threads calling fn meanwhile wait on the lock
+void compilelazy(ObjFunc *fn) {
+    ErrJmp ej;
+    pthread_mutex_lock(&lazylock);
+    if (!fn->lazy) {
+        pthread_mutex_unlock(&lazylock);
+        return;
+    }
+    pusherr(&ej);
+    if (setjmp(ej.jb)) {
+        pthread_mutex_unlock(&lazylock);
+        starfail("%s: %s", fn->chunk->name, ej.msg);
+    }
+    ObjFunc *body = compileinput(fn->lazy, strlen(fn->lazy), 0, 0, 0, 1);
+    poperr(&ej);
+    Chunk *c = fn->chunk, *bc = body->chunk;
+    Ins *ins = c->ins;
+    Value *cons = c->cons;
+    c->ins = bc->ins;
+    c->nins = bc->nins;
+    c->cons = bc->cons;
+    c->ncons = bc->ncons;
+    c->nregs = bc->nregs;
+    bc->ins = ins;
+    bc->nins = 0;
+    bc->cons = cons;
+    bc->ncons = 0;
+    freefunc(body);
+    char *lazy = fn->lazy;
+    __atomic_store_n(&fn->lazy, 0, __ATOMIC_RELEASE);
+    xfree(lazy);
+    pthread_mutex_unlock(&lazylock);
+}
+
+// a separate function with fn's body compiled, fn itself stays lazy
+ObjFunc *compilecopy(ObjFunc *fn) {
+    return compileinput(fn->lazy, strlen(fn->lazy), 0, 0, 0, 1);
+}
+
+ObjFunc *compilein(char *src, Scope *scope, int keep) {
+    return compilen(src, strlen(src), scope, keep);
+}
+
+ObjFunc *compile(char *src) {
+    return compilein(src, 0, 0);
+}
+
+// lexes and interns the whole source without parsing it
+int tokenize(char *src) {
+    Parser p;
+    initparser(&p, src, strlen(src), 0);
+    int ntoks = 0;
+    do {
+        advance(&p);
+        ntoks++;
+    } while (p.next.type != T_EOF);
+    freeparser(&p);
+    return ntoks;
+}
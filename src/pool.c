@@ -0,0 +1,93 @@
+#include <pthread.h>
+#include <string.h>
+#include <star/mem.h>
+#include <star/pool.h>
+
+// every worker owns a vm and reuses it across jobs, the functions are
+// only ever read so any number of workers can run the same one
+struct Pool {
+    pthread_t *threads;
+    int nthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    Job *jobs;
+    int njobs;
+    int next;
+    int pending;
+    int quit;
+};
+
+static void runjob(Vm *vm, Job *job) {
+    job->status = starrun(vm, job->fn);
+    job->result = nilval();
+    job->err[0] = 0;
+    if (job->status != STAR_OK)
+        strcpy(job->err, starerror(vm));
+    else if (starresult(vm).type != V_OBJ)
+        job->result = starresult(vm);
+    resetvm(vm);
+}
+
+static void *worker(void *arg) {
+    Pool *p = arg;
+    Vm *vm = newvm(); // allocated here so it's counted on this thread
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (!p->quit && p->next == p->njobs)
+            pthread_cond_wait(&p->work, &p->lock);
+        if (p->quit) break;
+        Job *job = &p->jobs[p->next++];
+        pthread_mutex_unlock(&p->lock);
+        runjob(vm, job);
+        pthread_mutex_lock(&p->lock);
+        if (!--p->pending)
+            pthread_cond_signal(&p->done);
+    }
+    pthread_mutex_unlock(&p->lock);
+    freevm(vm);
+    return 0;
+}
+
+Pool *newpool(int nthreads) {
+    Pool *p = xmalloc(sizeof(Pool));
+    memset(p, 0, sizeof(Pool));
+    p->nthreads = nthreads > 0 ? nthreads : 1;
+    p->threads = xmalloc(p->nthreads * sizeof(pthread_t));
+    pthread_mutex_init(&p->lock, 0);
+    pthread_cond_init(&p->work, 0);
+    pthread_cond_init(&p->done, 0);
+    for (int i = 0; i < p->nthreads; i++)
+        pthread_create(&p->threads[i], 0, worker, p);
+    return p;
+}
+
+void freepool(Pool *p) {
+    pthread_mutex_lock(&p->lock);
+    p->quit = 1;
+    pthread_cond_broadcast(&p->work);
+    pthread_mutex_unlock(&p->lock);
+    for (int i = 0; i < p->nthreads; i++)
+        pthread_join(p->threads[i], 0);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->work);
+    pthread_cond_destroy(&p->done);
+    xfree(p->threads);
+    xfree(p);
+}
+
+// blocks until every job has finished
+void runjobs(Pool *p, Job *jobs, int njobs) {
+    if (!njobs) return;
+    pthread_mutex_lock(&p->lock);
+    p->jobs = jobs;
+    p->njobs = njobs;
+    p->next = 0;
+    p->pending = njobs;
+    pthread_cond_broadcast(&p->work);
+    while (p->pending)
+        pthread_cond_wait(&p->done, &p->lock);
+    p->jobs = 0;
+    p->njobs = p->next = 0;
+    pthread_mutex_unlock(&p->lock);
+}
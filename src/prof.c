@@ -0,0 +1,222 @@
+#include <stdlib.h>
+#include <string.h>
+#include <star/mem.h>
+#include <star/prof.h>
+
+#define TOPN 20
+
+Prof *newprof() {
+    Prof *p = xmalloc(sizeof(Prof));
+    memset(p, 0, sizeof(Prof));
+    return p;
+}
+
+void freeprof(Prof *p) {
+    for (int i = 0; i < p->nchunks; i++) {
+        ProfChunk *pc = &p->chunks[i];
+        if (!pc->name) continue;
+        xfree(pc->name);
+        xfree(pc->ops);
+        xfree(pc->ins);
+    }
+    if (p->chunks) xfree(p->chunks);
+    xfree(p);
+}
+
+// chunks are indexed by id, what's needed for the report is copied
+// so the chunk can be freed before the profile is
+ProfChunk *profenter(Prof *p, Chunk *c) {
+    if (c->id < 0) c->id = newchunkid(); // mapped from an image
+    if (c->id >= p->nchunks) {
+        int n = p->nchunks ? p->nchunks : 8;
+        while (n <= c->id) n *= 2;
+        p->chunks = p->chunks
+            ? xrealloc(p->chunks, n * sizeof(ProfChunk))
+            : xmalloc(n * sizeof(ProfChunk));
+        memset(p->chunks + p->nchunks, 0,
+                (n - p->nchunks) * sizeof(ProfChunk));
+        p->nchunks = n;
+    }
+    ProfChunk *pc = &p->chunks[c->id];
+    if (!pc->name) {
+        pc->name = xmalloc(strlen(c->name) + 1);
+        strcpy(pc->name, c->name);
+        pc->nins = c->nins;
+        pc->ops = xmalloc(c->nins + 1);
+        for (int i = 0; i < c->nins; i++)
+            pc->ops[i] = c->ins[i].op;
+        pc->ins = xmalloc((c->nins + 1) * sizeof(ProfCount));
+        memset(pc->ins, 0, (c->nins + 1) * sizeof(ProfCount));
+    }
+    pc->calls++;
+    return pc;
+}
+
+typedef struct {
+    int a, b;
+    uint64_t count;
+    uint64_t cycles;
+} Row;
+
+static int rowcmp(const void *a, const void *b) {
+    const Row *l = a, *r = b;
+    if (l->cycles != r->cycles) return l->cycles < r->cycles ? 1 : -1;
+    if (l->count != r->count) return l->count < r->count ? 1 : -1;
+    return 0;
+}
+
+static Row *oprows(Prof *p, int *n) {
+    Row *rows = xmalloc(NOPS * sizeof(Row));
+    *n = 0;
+    for (int op = 0; op < NOPS; op++) {
+        if (!p->ops[op].count) continue;
+        rows[(*n)++] = (Row){op, 0, p->ops[op].count, p->ops[op].cycles};
+    }
+    qsort(rows, *n, sizeof(Row), rowcmp);
+    return rows;
+}
+
+static Row *funcrows(Prof *p, int *n) {
+    Row *rows = xmalloc((p->nchunks + 1) * sizeof(Row));
+    *n = 0;
+    for (int i = 0; i < p->nchunks; i++) {
+        ProfChunk *pc = &p->chunks[i];
+        if (!pc->name) continue;
+        Row r = {i, 0, 0, 0};
+        for (int ip = 0; ip < pc->nins; ip++) {
+            r.count += pc->ins[ip].count;
+            r.cycles += pc->ins[ip].cycles;
+        }
+        rows[(*n)++] = r;
+    }
+    qsort(rows, *n, sizeof(Row), rowcmp);
+    return rows;
+}
+
+static Row *insrows(Prof *p, int *n) {
+    int cap = 16;
+    Row *rows = xmalloc(cap * sizeof(Row));
+    *n = 0;
+    for (int i = 0; i < p->nchunks; i++) {
+        ProfChunk *pc = &p->chunks[i];
+        for (int ip = 0; pc->name && ip < pc->nins; ip++) {
+            if (!pc->ins[ip].count) continue;
+            if (*n == cap) rows = xrealloc(rows, (cap *= 2) * sizeof(Row));
+            rows[(*n)++] = (Row){i, ip, pc->ins[ip].count, pc->ins[ip].cycles};
+        }
+    }
+    qsort(rows, *n, sizeof(Row), rowcmp);
+    return rows;
+}
+
+static Row *pairrows(Prof *p, int *n) {
+    Row *rows = xmalloc(NOPS * NOPS * sizeof(Row));
+    *n = 0;
+    for (int a = 1; a < NOPS; a++) // OP_NONE marks function entry
+        for (int b = 0; b < NOPS; b++)
+            if (p->pairs[a][b])
+                rows[(*n)++] = (Row){a, b, 0, p->pairs[a][b]};
+    qsort(rows, *n, sizeof(Row), rowcmp);
+    return rows;
+}
+
+static void totals(Prof *p, uint64_t *count, uint64_t *cycles) {
+    *count = *cycles = 0;
+    for (int op = 0; op < NOPS; op++) {
+        *count += p->ops[op].count;
+        *cycles += p->ops[op].cycles;
+    }
+}
+
+static double pct(uint64_t part, uint64_t total) {
+    return total ? 100.0 * part / total : 0;
+}
+
+void profreport(Prof *p, FILE *fp) {
+    uint64_t count, cycles;
+    Row *rows;
+    int n;
+    totals(p, &count, &cycles);
+    fprintf(fp, "--- Profile ---\n");
+    fprintf(fp, "instructions: %llu\n", (unsigned long long)count);
+    fprintf(fp, "cycles: %llu\n", (unsigned long long)cycles);
+    fprintf(fp, "Opcodes:\n");
+    rows = oprows(p, &n);
+    for (int i = 0; i < n; i++)
+        fprintf(fp, "    %-10s %12llu %14llu %6.2f%%\n", opname(rows[i].a),
+                (unsigned long long)rows[i].count,
+                (unsigned long long)rows[i].cycles, pct(rows[i].cycles, cycles));
+    xfree(rows);
+    fprintf(fp, "Functions:\n");
+    rows = funcrows(p, &n);
+    for (int i = 0; i < n; i++) {
+        ProfChunk *pc = &p->chunks[rows[i].a];
+        fprintf(fp, "    %-16s %8llu calls %12llu %14llu %6.2f%%\n", pc->name,
+                (unsigned long long)pc->calls, (unsigned long long)rows[i].count,
+                (unsigned long long)rows[i].cycles, pct(rows[i].cycles, cycles));
+    }
+    xfree(rows);
+    fprintf(fp, "Instructions:\n");
+    rows = insrows(p, &n);
+    for (int i = 0; i < n && i < TOPN; i++) {
+        ProfChunk *pc = &p->chunks[rows[i].a];
+        fprintf(fp, "    %-12s %4i %-10s %12llu %14llu %6.2f%%\n", pc->name,
+                rows[i].b, opname(pc->ops[rows[i].b]),
+                (unsigned long long)rows[i].count,
+                (unsigned long long)rows[i].cycles, pct(rows[i].cycles, cycles));
+    }
+    xfree(rows);
+    fprintf(fp, "Pairs:\n");
+    rows = pairrows(p, &n);
+    for (int i = 0; i < n && i < TOPN; i++)
+        fprintf(fp, "    %-10s %-10s %12llu\n", opname(rows[i].a),
+                opname(rows[i].b), (unsigned long long)rows[i].cycles);
+    xfree(rows);
+}
+
+void profjson(Prof *p, FILE *fp) {
+    uint64_t count, cycles;
+    Row *rows;
+    int n;
+    totals(p, &count, &cycles);
+    fprintf(fp, "{\n  \"instructions\": %llu,\n  \"cycles\": %llu,\n",
+            (unsigned long long)count, (unsigned long long)cycles);
+    fprintf(fp, "  \"opcodes\": [");
+    rows = oprows(p, &n);
+    for (int i = 0; i < n; i++)
+        fprintf(fp, "%s\n    {\"op\": \"%s\", \"count\": %llu, \"cycles\": %llu}",
+                i ? "," : "", opname(rows[i].a),
+                (unsigned long long)rows[i].count,
+                (unsigned long long)rows[i].cycles);
+    xfree(rows);
+    fprintf(fp, "\n  ],\n  \"functions\": [");
+    rows = funcrows(p, &n);
+    for (int i = 0; i < n; i++) {
+        ProfChunk *pc = &p->chunks[rows[i].a];
+        fprintf(fp, "%s\n    {\"id\": %i, \"name\": \"%s\", \"calls\": %llu, "
+                "\"count\": %llu, \"cycles\": %llu, \"instructions\": [",
+                i ? "," : "", rows[i].a, pc->name,
+                (unsigned long long)pc->calls, (unsigned long long)rows[i].count,
+                (unsigned long long)rows[i].cycles);
+        int first = 1;
+        for (int ip = 0; ip < pc->nins; ip++) {
+            if (!pc->ins[ip].count) continue;
+            fprintf(fp, "%s\n      {\"ip\": %i, \"op\": \"%s\", "
+                    "\"count\": %llu, \"cycles\": %llu}",
+                    first ? "" : ",", ip, opname(pc->ops[ip]),
+                    (unsigned long long)pc->ins[ip].count,
+                    (unsigned long long)pc->ins[ip].cycles);
+            first = 0;
+        }
+        fprintf(fp, "\n    ]}");
+    }
+    xfree(rows);
+    fprintf(fp, "\n  ],\n  \"pairs\": [");
+    rows = pairrows(p, &n);
+    for (int i = 0; i < n; i++)
+        fprintf(fp, "%s\n    {\"first\": \"%s\", \"second\": \"%s\", "
+                "\"count\": %llu}", i ? "," : "", opname(rows[i].a),
+                opname(rows[i].b), (unsigned long long)rows[i].cycles);
+    xfree(rows);
+    fprintf(fp, "\n  ]\n}\n");
+}
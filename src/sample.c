@@ -0,0 +1,144 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <star/mem.h>
+#include <star/util.h>
+#include <star/prof.h>
+
+// everything the signal handler touches is allocated up front,
+// samples with the same call chain are aggregated in place
+#define NSTACKS 16384
+#define NPOOL (1 << 20)
+
+typedef struct {
+    unsigned hash;
+    int off;
+    int depth;
+    uint64_t count;
+} Stack;
+
+struct Sampler {
+    Vm *vm;
+    int hz;
+    Stack *stacks;
+    Frame *pool;
+    int npool;
+    uint64_t nsamples;
+    uint64_t dropped;
+    struct sigaction old;
+};
+
+static Sampler *volatile active = 0;
+
+static unsigned framehash(Frame *frames, int depth) {
+    unsigned hash = 5381;
+    for (int i = 0; i < depth; i++) {
+        hash = hash * 33 + (unsigned)(uintptr_t)frames[i].chunk;
+        hash = hash * 33 + frames[i].ip;
+    }
+    return hash;
+}
+
+static int samestack(Sampler *s, Stack *st, Frame *frames, int depth) {
+    if (st->depth != depth) return 0;
+    Frame *f = &s->pool[st->off];
+    for (int i = 0; i < depth; i++)
+        if (f[i].chunk != frames[i].chunk || f[i].ip != frames[i].ip)
+            return 0;
+    return 1;
+}
+
+static void onsample(int sig) {
+    Sampler *s = active;
+    if (!s) return;
+    Vm *vm = s->vm;
+    int depth = vm->nframes < MAXFRAMES ? vm->nframes : MAXFRAMES;
+    if (!depth) return;
+    Frame *frames = vm->frames;
+    unsigned hash = framehash(frames, depth);
+    s->nsamples++;
+    for (int i = 0; i < NSTACKS; i++) {
+        Stack *st = &s->stacks[(hash + i) % NSTACKS];
+        if (st->count && st->hash == hash && samestack(s, st, frames, depth)) {
+            st->count++;
+            return;
+        }
+        if (st->count) continue;
+        if (s->npool + depth > NPOOL) break;
+        memcpy(&s->pool[s->npool], frames, depth * sizeof(Frame));
+        st->hash = hash;
+        st->off = s->npool;
+        st->depth = depth;
+        st->count = 1;
+        s->npool += depth;
+        return;
+    }
+    s->dropped++;
+}
+
+Sampler *startsampler(Vm *vm, int hz) {
+    if (active)
+        starfail("sampler already running");
+    Sampler *s = xmalloc(sizeof(Sampler));
+    memset(s, 0, sizeof(Sampler));
+    s->vm = vm;
+    vm->sampling = 1;
+    s->hz = hz > 0 ? hz : 1000;
+    s->stacks = xmalloc(NSTACKS * sizeof(Stack));
+    memset(s->stacks, 0, NSTACKS * sizeof(Stack));
+    s->pool = xmalloc(NPOOL * sizeof(Frame));
+    active = s;
+    struct sigaction sa = {0};
+    sa.sa_handler = onsample;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, &s->old);
+    long us = 1000000 / s->hz;
+    if (!us) us = 1;
+    struct itimerval it = {0};
+    it.it_interval.tv_sec = us / 1000000;
+    it.it_interval.tv_usec = us % 1000000;
+    it.it_value = it.it_interval;
+    if (setitimer(ITIMER_PROF, &it, 0) < 0) {
+        int err = errno;
+        freesampler(s);
+        starfail("can't start sampler at %i Hz: %s", hz, strerror(err));
+    }
+    return s;
+}
+
+void stopsampler(Sampler *s) {
+    struct itimerval it = {0};
+    setitimer(ITIMER_PROF, &it, 0);
+    sigaction(SIGPROF, &s->old, 0);
+    s->vm->sampling = 0;
+    active = 0;
+}
+
+// one line per distinct call chain, root first: main:16;getname:1 42
+// the chunks sampled have to still be alive
+void writefolded(Sampler *s, FILE *fp) {
+    for (int i = 0; i < NSTACKS; i++) {
+        Stack *st = &s->stacks[i];
+        if (!st->count) continue;
+        Frame *f = &s->pool[st->off];
+        for (int k = 0; k < st->depth; k++)
+            fprintf(fp, "%s%s:%i", k ? ";" : "", f[k].chunk->name, f[k].ip);
+        fprintf(fp, " %llu\n", (unsigned long long)st->count);
+    }
+}
+
+void samplerstats(Sampler *s, FILE *fp) {
+    fprintf(fp, "%llu samples at %i Hz, %llu dropped\n",
+            (unsigned long long)s->nsamples, s->hz,
+            (unsigned long long)s->dropped);
+}
+
+void freesampler(Sampler *s) {
+    if (active == s) stopsampler(s);
+    xfree(s->stacks);
+    xfree(s->pool);
+    xfree(s);
+}
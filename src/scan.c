@@ -0,0 +1,94 @@
+#include <star/scan.h>
+
+const unsigned char CCLASS[256] = {
+    [' '] = C_SPACE, ['\t' ... '\r'] = C_SPACE,
+    ['0' ... '9'] = C_DIGIT,
+    ['a' ... 'z'] = C_ALPHA, ['A' ... 'Z'] = C_ALPHA, ['_'] = C_ALPHA,
+};
+
+// the runs are scanned a vector at a time, a mask with a bit set for
+// every byte that ends the run finds where it stops
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define W 32
+typedef __m256i V;
+#define load(s) _mm256_loadu_si256((V *)(s))
+#define set1 _mm256_set1_epi8
+#define eq _mm256_cmpeq_epi8
+#define or _mm256_or_si256
+#define sub _mm256_sub_epi8
+#define min _mm256_min_epu8
+#define mask(v) (unsigned)_mm256_movemask_epi8(v)
+#define NOT(m) (~(m))
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define W 16
+typedef __m128i V;
+#define load(s) _mm_loadu_si128((V *)(s))
+#define set1 _mm_set1_epi8
+#define eq _mm_cmpeq_epi8
+#define or _mm_or_si128
+#define sub _mm_sub_epi8
+#define min _mm_min_epu8
+#define mask(v) (unsigned)_mm_movemask_epi8(v)
+#define NOT(m) (~(m) & 0xffff)
+#endif
+
+#ifdef W
+// bytes from lo to lo + n
+static inline V inrange(V v, char lo, char n) {
+    V t = sub(v, set1(lo));
+    return eq(min(t, set1(n)), t);
+}
+
+static inline unsigned notspace(V v) {
+    return NOT(mask(or(eq(v, set1(' ')), inrange(v, '\t', '\r' - '\t'))));
+}
+
+// letters are folded to lower case, nothing else lands on a-z
+static inline unsigned notident(V v) {
+    V alpha = inrange(or(v, set1(0x20)), 'a', 'z' - 'a');
+    V digit = inrange(v, '0', 9);
+    return NOT(mask(or(or(alpha, digit), eq(v, set1('_')))));
+}
+
+static inline unsigned notdigit(V v) {
+    return NOT(mask(inrange(v, '0', 9)));
+}
+
+static inline unsigned quote(V v) {
+    return mask(eq(v, set1('"')));
+}
+
+#define SCAN(s, end, stop) \
+    for (; s + W <= end; s += W) { \
+        unsigned m = stop(load(s)); \
+        if (m) return s + __builtin_ctz(m); \
+    }
+#else
+#define SCAN(s, end, stop)
+#endif
+
+char *skipspace(char *s, char *end) {
+    SCAN(s, end, notspace);
+    while (s < end && CCLASS[(unsigned char)*s] & C_SPACE) s++;
+    return s;
+}
+
+char *skipident(char *s, char *end) {
+    SCAN(s, end, notident);
+    while (s < end && CCLASS[(unsigned char)*s] & (C_ALPHA | C_DIGIT)) s++;
+    return s;
+}
+
+char *skipdigits(char *s, char *end) {
+    SCAN(s, end, notdigit);
+    while (s < end && CCLASS[(unsigned char)*s] & C_DIGIT) s++;
+    return s;
+}
+
+char *findquote(char *s, char *end) {
+    SCAN(s, end, quote);
+    while (s < end && *s != '"') s++;
+    return s;
+}
@@ -1,49 +1,36 @@
 #include <stdlib.h>
+#include <alloca.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <star/mem.h>
 #include <star/util.h>
 #include <star/star.h>
+#include <star/prof.h>
 
-#define OPS(OP) OP(NONE) OP(RET) OP(CONS) OP(NIL) OP(NEW) \
-        OP(ADD) OP(SUB) OP(MUL) OP(DIV) \
-        OP(NEG) \
-        OP(PRINT) \
-        OP(POP) \
-        OP(GET_LOCAL) OP(SET_LOCAL) \
-        OP(GET_FIELD) OP(SET_FIELD) \
-        OP(CJMP) OP(JMP) \
-        OP(NOP) \
-        OP(NOT) \
-        OP(TRUE) OP(FALSE) \
-        OP(LT) OP(GT) OP(EQ) OP(AND) OP(OR) \
-        OP(SWAP) \
-        OP(CALL) \
-        OP(DUP)
-
-#define OBJS(O) O(NONE) O(STR) O(TAB) O(FUNC)
-
-enum {
-#define OP(name) OP_ ## name,
-    OPS(OP)
-#undef OP
-};
+// atomic so scripts can be compiled on several threads at once
+static _Atomic int nextchunkid = 0;
 
-enum {
-#define O(name) OBJ_ ## name,
-    OBJS(O)
-#undef V
-};
+int newchunkid() {
+    return nextchunkid++;
+}
 
 Chunk *newchunk() {
     Chunk *c = xmalloc(sizeof(Chunk));
     memset(c, 0, sizeof(Chunk));
     c->ins = newarray(sizeof(Ins));
     c->cons = newarray(sizeof(Value));
+    c->id = newchunkid();
+    setname(c, "function");
     return c;
 }
 
+void setname(Chunk *c, char *name) {
+    if (c->name) xfree(c->name);
+    c->name = xmalloc(strlen(name) + 1);
+    strcpy(c->name, name);
+}
+
 Vm *newvm() {
     Vm *vm = xmalloc(sizeof(Vm));
     memset(vm, 0, sizeof(Vm));
@@ -53,16 +40,61 @@ Vm *newvm() {
 
 static void *allocobj(int size) {
     Obj *o = xmalloc(size);
+    o->next = 0;
     return o;
 }
 
+// the vm owns v from now on and frees it with everything else it made
+Value startrack(Vm *vm, Value v) {
+    v.as.obj->next = vm->objs;
+    vm->objs = v.as.obj;
+    return v;
+}
+
 static void freeobj(Obj *o) {
-    if (o->type == OBJ_STR)
-        xfree(((ObjString *)o)->str);
+    switch (o->type) {
+    case OBJ_NATIVE:
+        return;
+    case OBJ_SLICE:
+        if (((ObjSlice *)o)->copy) xfree(((ObjSlice *)o)->copy);
+        break;
+    case OBJ_TAB:
+        freevaltab(((ObjTab *)o)->fields);
+        break;
+    case OBJ_ARR:
+        if (!((ObjArr *)o)->mapped) xfree(((ObjArr *)o)->items);
+        break;
+    case OBJ_FUNC:
+        freechunk(((ObjFunc *)o)->chunk);
+        if (((ObjFunc *)o)->lazy) xfree(((ObjFunc *)o)->lazy);
+        break;
+    }
     xfree(o);
 }
 
+void freefunc(ObjFunc *fn) {
+    freeobj((Obj *)fn);
+}
+
+// drops the stack and everything allocated by previous runs
+void resetvm(Vm *vm) {
+    Obj *next;
+    for (Obj *o = vm->objs; o; o = next) {
+        next = o->next;
+        freeobj(o);
+    }
+    vm->objs = 0;
+    vm->nstack = 0;
+    vm->nbase = 0;
+    vm->nframes = 0;
+    vm->err[0] = 0;
+    // the cache points into tables that are gone now
+    memset(vm->fcache, 0, sizeof(vm->fcache));
+    vm->epoch = 0;
+}
+
 void freevm(Vm *vm) {
+    resetvm(vm);
     freearray(vm->stack);
     xfree(vm);
 }
@@ -71,36 +103,116 @@ void freechunk(Chunk *c) {
     freearray(c->ins);
     for (int i = 0; i < c->ncons; i++) {
         if (c->cons[i].type != V_OBJ) continue;
-        freeobj(c->cons[i].as.obj);
+        Obj *o = c->cons[i].as.obj;
+        if (o->type == OBJ_TAB) freetemplate((ObjTab *)o);
+        else freeobj(o);
     }
     freearray(c->cons);
+    xfree(c->name);
     xfree(c);
 }
 
-static ObjTab *alloctab() {
+// a copy of shape's keys and values when given, nothing to grow into
+static ObjTab *alloctab(ValTab *shape) {
     ObjTab *o = allocobj(sizeof(ObjTab));
     o->hdr.type = OBJ_TAB;
-    o->fields = newvaltab();
+    o->fields = shape ? copyvaltab(shape) : newvaltab();
+    o->proto = 0;
+    o->isproto = 0;
     return o;
 }
 
-static ObjString *allocstr(char *str) {
-    ObjString *o = allocobj(sizeof(ObjString));
+static ObjArr *allocarr(int cap) {
+    ObjArr *o = allocobj(sizeof(ObjArr));
+    o->hdr.type = OBJ_ARR;
+    o->items = xmalloc((cap ? cap : 1) * sizeof(Value));
+    o->len = 0;
+    o->cap = cap ? cap : 1;
+    o->mapped = 0;
+    return o;
+}
+
+static ObjBuf *allocbuf(int len) {
+    ObjBuf *o = allocobj(sizeof(ObjBuf) + len * sizeof(double));
+    o->hdr.type = OBJ_BUF;
+    o->len = len;
+    memset(o->data, 0, len * sizeof(double));
+    return o;
+}
+
+// characters are stored inline, the caller fills them in and calls hashstr
+static ObjString *newstr(int len) {
+    ObjString *o = allocobj(sizeof(ObjString) + len + 1);
     o->hdr.type = OBJ_STR;
-    o->len = strlen(str);
-    o->str = xmalloc(o->len + 1);
-    strcpy(o->str, str);
-    o->hash = strhash(str);
+    o->len = len;
+    o->str[len] = 0;
+    return o;
+}
+
+static ObjString *hashstr(ObjString *o) {
+    o->hash = strhash(o->str);
     return o;
 }
 
+static ObjString *allocstr(char *str) {
+    ObjString *o = newstr(strlen(str));
+    memcpy(o->str, str, o->len);
+    return hashstr(o);
+}
+
 ObjFunc *newfunc() {
     ObjFunc *o = allocobj(sizeof(ObjFunc));
     o->hdr.type = OBJ_FUNC;
     o->chunk = newchunk();
+    o->lazy = 0;
     return o;
 }
 
+ObjTab *newtemplate() {
+    return alloctab(0);
+}
+
+void addtemplatekey(ObjTab *t, char *name) {
+    Value v;
+    ObjString *key = (ObjString *)strval(name).as.obj;
+    if (valtabget(t->fields, key, &v)) {
+        freeobj((Obj *)key);
+        return;
+    }
+    valtabset(t->fields, key, nilval());
+}
+
+// keeps the slot order, copies of a literal iterate the same way
+ObjTab *copytemplate(ObjTab *t) {
+    ObjTab *cp = alloctab(t->fields);
+    ValTab *vt = cp->fields;
+    for (int i = 0; i < vt->nslots; i++)
+        if (vt->slots[i].key.type != V_NONE)
+            vt->slots[i].key = strval(strobj(vt->slots[i].key)->str);
+    return cp;
+}
+
+void freetemplate(ObjTab *t) {
+    Value key, v;
+    int idx = 0;
+    while ((idx = valtabnext(t->fields, idx, &key, &v)))
+        freeobj(key.as.obj);
+    freeobj((Obj *)t);
+}
+
+void setproto(Vm *vm, ObjTab *t, ObjTab *p) {
+    int depth = 1;
+    for (ObjTab *q = p; q; q = q->proto, depth++) {
+        if (q == t)
+            starfail("prototype chain can't loop");
+        if (depth > MAXPROTO)
+            starfail("prototype chain longer than %i", MAXPROTO);
+    }
+    t->proto = p;
+    if (p) p->isproto = 1;
+    vm->epoch++;
+}
+
 Value numval(double num) {
     return (Value){V_NUM, {.num = num}};
 }
@@ -117,6 +229,109 @@ Value strval(char *str) {
     return (Value){V_OBJ, {.obj = (Obj *)allocstr(str)}};
 }
 
+static int isvstr(Value v) {
+    if (v.type != V_OBJ) return 0;
+    return v.as.obj->type == OBJ_STR || v.as.obj->type == OBJ_SLICE;
+}
+
+static char *strchars(Value v, int *len) {
+    if (v.as.obj->type == OBJ_SLICE) {
+        ObjSlice *sl = (ObjSlice *)v.as.obj;
+        *len = sl->len;
+        return sl->parent->str + sl->off;
+    }
+    ObjString *str = (ObjString *)v.as.obj;
+    *len = str->len;
+    return str->str;
+}
+
+static unsigned strvhash(Value v) {
+    if (v.as.obj->type == OBJ_STR)
+        return ((ObjString *)v.as.obj)->hash;
+    ObjSlice *sl = (ObjSlice *)v.as.obj;
+    if (!sl->hashed) {
+        sl->hash = strhashn(sl->parent->str + sl->off, sl->len);
+        sl->hashed = 1;
+    }
+    return sl->hash;
+}
+
+// materializes slices, the copy is kept so it's made at most once
+ObjString *strobj(Value v) {
+    if (v.as.obj->type == OBJ_STR)
+        return (ObjString *)v.as.obj;
+    ObjSlice *sl = (ObjSlice *)v.as.obj;
+    if (!sl->copy) {
+        sl->copy = newstr(sl->len);
+        memcpy(sl->copy->str, sl->parent->str + sl->off, sl->len);
+        hashstr(sl->copy);
+    }
+    return sl->copy;
+}
+
+Value sliceval(Value str, int off, int len) {
+    if (!isvstr(str))
+        starfail("can only slice strings");
+    int n;
+    strchars(str, &n);
+    if (off < 0 || len < 0 || off > n || len > n - off)
+        starfail("slice of %i from %i out of range", len, off);
+    ObjSlice *sl = allocobj(sizeof(ObjSlice));
+    memset(sl, 0, sizeof(ObjSlice));
+    sl->hdr.type = OBJ_SLICE;
+    if (str.as.obj->type == OBJ_SLICE) {
+        ObjSlice *parent = (ObjSlice *)str.as.obj;
+        sl->parent = parent->parent;
+        sl->off = parent->off + off;
+    }
+    else {
+        sl->parent = (ObjString *)str.as.obj;
+        sl->off = off;
+    }
+    sl->len = len;
+    return OBJVAL(sl);
+}
+
+Value arrval(int cap) {
+    return OBJVAL(allocarr(cap));
+}
+
+void arrpush(ObjArr *arr, Value v) {
+    if (arr->len == arr->cap) {
+        arr->cap *= 2;
+        if (arr->mapped) {
+            Value *items = xmalloc(arr->cap * sizeof(Value));
+            memcpy(items, arr->items, arr->len * sizeof(Value));
+            arr->items = items;
+            arr->mapped = 0;
+        }
+        else
+            arr->items = xrealloc(arr->items, arr->cap * sizeof(Value));
+    }
+    arr->items[arr->len++] = v;
+}
+
+Value bufval(int len) {
+    return OBJVAL(allocbuf(len));
+}
+
+static int valeq(Value l, Value r) {
+    if (isvstr(l) && isvstr(r)) {
+        int llen, rlen;
+        char *lstr = strchars(l, &llen);
+        char *rstr = strchars(r, &rlen);
+        return llen == rlen && memcmp(lstr, rstr, llen) == 0;
+    }
+    if (l.type != r.type) return 0;
+    switch (l.type) {
+    case V_NIL: return 1;
+    case V_NUM: return l.as.num == r.as.num;
+    case V_BOOL: return l.as.boolean == r.as.boolean;
+    case V_OBJ: return l.as.obj == r.as.obj;
+    }
+    return 0;
+}
+
 int addcons(Chunk *c, Value v) {
     int idx = c->ncons++;
     c->cons = arraygrow(c->cons, c->ncons);
@@ -235,8 +450,8 @@ int emitnil(Chunk *c) {
     return emit(c, (Ins){OP_NIL});
 }
 
-int emitnew(Chunk *c) {
-    return emit(c, (Ins){OP_NEW});
+int emitnew(Chunk *c, int tmpl) {
+    return emit(c, (Ins){OP_NEW, tmpl});
 }
 
 int emitdup(Chunk *c) {
@@ -247,6 +462,38 @@ int emitcall(Chunk *c, int nargs) {
     return emit(c, (Ins){OP_CALL, nargs});
 }
 
+int emitarr(Chunk *c, int n) {
+    return emit(c, (Ins){OP_ARR, n});
+}
+
+int emitgetindex(Chunk *c) {
+    return emit(c, (Ins){OP_GET_INDEX});
+}
+
+int emitsetindex(Chunk *c) {
+    return emit(c, (Ins){OP_SET_INDEX});
+}
+
+int emitdelete(Chunk *c) {
+    return emit(c, (Ins){OP_DELETE});
+}
+
+int emitlen(Chunk *c) {
+    return emit(c, (Ins){OP_LEN});
+}
+
+int emititer(Chunk *c) {
+    return emit(c, (Ins){OP_ITER});
+}
+
+int emitguard(Chunk *c, int consid) {
+    return emit(c, (Ins){OP_GUARD, consid});
+}
+
+int emitslide(Chunk *c, int n) {
+    return emit(c, (Ins){OP_SLIDE, n});
+}
+
 void patchjmp(Chunk *c, int ip) {
     c->ins[ip].arg = c->nins - ip;
 }
@@ -257,18 +504,29 @@ static const char *valname(int type) {
     VALS(V)
 #undef V
     }
-    printf("*** unknown value type %i\n", type);
-    exit(1);
+    starfail("unknown value type %i", type);
 }
 
-static const char *opname(int op) {
+const char *typname(Value v) {
+    if (v.type != V_OBJ) return valname(v.type);
+    switch (v.as.obj->type) {
+    case OBJ_STR: case OBJ_SLICE: return "STR";
+    case OBJ_TAB: return "TAB";
+    case OBJ_FUNC: return "FUNC";
+    case OBJ_ARR: return "ARR";
+    case OBJ_BUF: return "BUF";
+    case OBJ_NATIVE: return "NATIVE";
+    }
+    return "OBJ";
+}
+
+const char *opname(int op) {
     switch (op) {
 #define OP(name) case OP_ ## name: return #name;
     OPS(OP)
 #undef OP
     }
-    printf("*** unknown op %i\n", op);
-    exit(1);
+    starfail("unknown op %i", op);
 }
 
 int getip(Chunk *c) {
@@ -286,9 +544,28 @@ void fixassign(Chunk *c, int ip) {
         c->ins[ip].op = OP_NOP;
         emitsetfield(c, i.arg);
         return;
+    case OP_GET_INDEX:
+        c->ins[ip].op = OP_NOP;
+        emitsetindex(c);
+        return;
     }
-    printf("*** left-hand side not an lvalue\n");
-    exit(1);
+    starfail("left-hand side not an lvalue");
+}
+
+// DELETE takes the table and the key, a field's name becomes the key
+void fixdelete(Chunk *c, int ip) {
+    Ins i = c->ins[ip];
+    switch (i.op) {
+    case OP_GET_FIELD:
+        c->ins[ip] = (Ins){OP_CONS, i.arg};
+        emitdelete(c);
+        return;
+    case OP_GET_INDEX:
+        c->ins[ip].op = OP_NOP;
+        emitdelete(c);
+        return;
+    }
+    starfail("can only delete fields and indexes");
 }
 
 static void printval(Value v) {
@@ -298,15 +575,21 @@ static void printval(Value v) {
     case V_NUM: printf("%f", v.as.num); return;
     case V_OBJ: {
         switch (v.as.obj->type) {
-        case OBJ_STR: printf("\"%s\"", ((ObjString *)v.as.obj)->str); return;
+        case OBJ_STR:
+        case OBJ_SLICE: {
+            int len;
+            char *str = strchars(v, &len);
+            printf("\"%.*s\"", len, str);
+            return;
+        }
         case OBJ_TAB: {
             printf("{");
             ObjTab *tab = (ObjTab *)v.as.obj;
-            ObjString *key;
-            Value v;
+            Value key, v;
             int idx = 0;
             while ((idx = valtabnext(tab->fields, idx, &key, &v))) {
-                printf("\"%s\": ", key->str);
+                printval(key);
+                printf(": ");
                 printval(v);
                 printf(", ");
             }
@@ -314,13 +597,41 @@ static void printval(Value v) {
             return;
         }
         case OBJ_FUNC: printf("{Object Function}"); return;
+        case OBJ_NATIVE:
+            printf("{Native %s}", ((ObjNative *)v.as.obj)->name);
+            return;
+        case OBJ_ARR: {
+            printf("[");
+            ObjArr *arr = (ObjArr *)v.as.obj;
+            for (int i = 0; i < arr->len; i++) {
+                printval(arr->items[i]);
+                printf(", ");
+            }
+            printf("]");
+            return;
+        }
+        case OBJ_BUF: {
+            printf("buf[");
+            ObjBuf *buf = (ObjBuf *)v.as.obj;
+            for (int i = 0; i < buf->len; i++)
+                printf("%f, ", buf->data[i]);
+            printf("]");
+            return;
+        }
         }
     }
     }
     printf("???");
 }
 
+// nested functions first, the same order they finish compiling in
 void printchunk(Chunk *c) {
+    for (int i = 0; i < c->ncons; i++) {
+        Value cons = c->cons[i];
+        if (cons.type == V_OBJ && cons.as.obj->type == OBJ_FUNC
+                && !((ObjFunc *)cons.as.obj)->lazy)
+            printchunk(((ObjFunc *)cons.as.obj)->chunk);
+    }
     printf("--- Chunk ---\n");
     printf("Constants:\n");
     for (int i = 0; i < c->ncons; i++) {
@@ -346,19 +657,26 @@ void printchunk(Chunk *c) {
         case OP_NOT:
         case OP_LT: case OP_GT: case OP_EQ:
         case OP_NIL:
-        case OP_NEW:
         case OP_DUP:
         case OP_SWAP:
         case OP_TRUE: case OP_FALSE:
-        case OP_AND: case OP_OR:
+        case OP_GET_INDEX: case OP_SET_INDEX:
+        case OP_DELETE:
+        case OP_LEN:
             printf("%s", opname(i.op));
             break;
         case OP_CALL:
+        case OP_NEW:
         case OP_CONS:
         case OP_GET_LOCAL: case OP_SET_LOCAL:
         case OP_GET_FIELD: case OP_SET_FIELD:
         case OP_CJMP:
         case OP_JMP:
+        case OP_AND: case OP_OR:
+        case OP_ARR:
+        case OP_ITER:
+        case OP_GUARD: case OP_SLIDE:
+        case OP_GET_REG: case OP_SET_REG:
             printf("%s %i", opname(i.op), i.arg);
             break;
         default: printf("???"); break;
@@ -374,18 +692,14 @@ static void push(Vm *vm, Value v) {
 }
 
 static Value peek(Vm *vm, int off) {
-   if (vm->nstack - 1 - off < 0) {
-        printf("*** stack underflow\n");
-        exit(1);
-   }
+   if (vm->nstack - 1 - off < 0)
+       starfail("stack underflow");
    return vm->stack[vm->nstack - 1 - off];
 }
 
 static Value pop(Vm *vm) {
-    if (!vm->nstack) {
-        printf("*** stack underflow\n");
-        exit(1);
-    }
+    if (!vm->nstack)
+        starfail("stack underflow");
     return vm->stack[--vm->nstack];
 }
 
@@ -397,10 +711,6 @@ static int istrue(Value v) {
     return 0;
 }
 
-static int isvstr(Value v) {
-    return v.type == V_OBJ && v.as.obj->type == OBJ_STR;
-}
-
 void printstack(Vm *vm) {
     printf("--- Stack ---\n");
     for (int i = 0; i < vm->nstack; i++) {
@@ -412,6 +722,10 @@ void printstack(Vm *vm) {
 }
 
 static void binop(Vm *vm, Value l, Value r, int op) {
+    if (op == OP_EQ) {
+        push(vm, boolval(valeq(l, r)));
+        return;
+    }
     if (l.type == V_NUM && r.type == V_NUM) {
         switch (op) {
         case OP_ADD: push(vm, numval(l.as.num + r.as.num)); return;
@@ -420,72 +734,236 @@ static void binop(Vm *vm, Value l, Value r, int op) {
         case OP_DIV: push(vm, numval(l.as.num / r.as.num)); return;
         case OP_LT: push(vm, boolval(l.as.num < r.as.num)); return;
         case OP_GT: push(vm, boolval(l.as.num > r.as.num)); return;
-        case OP_EQ: push(vm, boolval(l.as.num == r.as.num)); return;
-        }
-    }
-    else if (l.type == V_BOOL && r.type == V_BOOL) {
-        switch (op) {
-        case OP_AND: push(vm, boolval(l.as.boolean && r.as.boolean)); return;
-        case OP_OR: push(vm, boolval(l.as.boolean || r.as.boolean)); return;
         }
     }
     else if (isvstr(l) && isvstr(r) && op == OP_ADD) {
-        ObjString *lstr = (void *)l.as.obj;
-        ObjString *rstr = (void *)r.as.obj;
-        int len = lstr->len + rstr->len;
-        char *str = xmalloc(len + 1);
-        strcpy(str, lstr->str);
-        strcpy(str + lstr->len, rstr->str);
-        Value v = strval(str);
-        push(vm, v);
-        xfree(str);
+        int llen, rlen;
+        char *lstr = strchars(l, &llen);
+        char *rstr = strchars(r, &rlen);
+        if (l.as.obj->type == OBJ_SLICE && r.as.obj->type == OBJ_SLICE
+                && ((ObjSlice *)l.as.obj)->parent == ((ObjSlice *)r.as.obj)->parent
+                && lstr + llen == rstr) {
+            // adjacent pieces of the same parent
+            ObjSlice *sl = (ObjSlice *)l.as.obj;
+            push(vm, startrack(vm, sliceval(OBJVAL(sl->parent),
+                    sl->off, llen + rlen)));
+            return;
+        }
+        ObjString *str = newstr(llen + rlen);
+        memcpy(str->str, lstr, llen);
+        memcpy(str->str + llen, rstr, rlen);
+        push(vm, startrack(vm, OBJVAL(hashstr(str))));
         return;
     }
     else if ((l.type == V_NUM && isvstr(r)) || (r.type == V_NUM && isvstr(l))) {
         int n = l.type == V_NUM ? l.as.num : r.as.num;
         Value str = isvstr(l) ? l : r;
-        push(vm, strval(""));
+        push(vm, startrack(vm, strval("")));
         for (int i = 0; i < n; i++)
             binop(vm, pop(vm), str, OP_ADD);
         return;
     }
-    printf("*** can't execute binop %s on ", opname(op));
-    printval(l); printf(" and "); printval(r);
-    printf("\n");
-    exit(1);
+    starfail("can't execute binop %s on %s and %s",
+            opname(op), typname(l), typname(r));
+}
+
+// only whole numbers in range index anything, strings give one char slices
+static int toindex(Value idx, int len) {
+    if (idx.type != V_NUM)
+        starfail("index has to be a number, got %s", typname(idx));
+    double n = idx.as.num;
+    if (!(n >= 0 && n < len) || n != (int)n)
+        starfail("index %g out of range [0, %i)", n, len);
+    return n;
+}
+
+static void pushfield(Vm *vm, Value vtab, Value vname, FieldCache *fc);
+
+// deleting a key that isn't there does nothing
+static void delindex(Vm *vm, Value v, Value idx) {
+    if (v.type != V_OBJ || v.as.obj->type != OBJ_TAB)
+        starfail("can only delete from tables, got %s", typname(v));
+    ObjTab *tab = (ObjTab *)v.as.obj;
+    if (tab->isproto) vm->epoch++;
+    if (idx.type == V_NUM)
+        valtabdelnum(tab->fields, idx.as.num);
+    else if (isvstr(idx))
+        valtabdel(tab->fields, strobj(idx));
+    else
+        starfail("table keys have to be strings or numbers, got %s",
+                typname(idx));
 }
 
-static void pushfield(Vm *vm, Value vtab, Value vname) {
-    if (vtab.type != V_OBJ || vtab.as.obj->type != OBJ_TAB) {
-        printf("*** only tables have fields\n");
-        exit(1);
+// tables take numbers and strings, a missing key gives nil
+static void pushindex(Vm *vm, Value v, Value idx) {
+    if (v.type == V_OBJ && v.as.obj->type == OBJ_TAB && idx.type == V_NUM) {
+        Value item;
+        if (!valtabgetnum(((ObjTab *)v.as.obj)->fields, idx.as.num, &item))
+            item = nilval();
+        push(vm, item);
+        return;
+    }
+    if (v.type == V_OBJ && v.as.obj->type == OBJ_TAB) {
+        pushfield(vm, v, idx, 0);
+        return;
     }
-    if (vname.type != V_OBJ || vname.as.obj->type != OBJ_STR) {
-        printf("*** field name has to be a string\n");
-        exit(1);
+    if (v.type == V_OBJ && v.as.obj->type == OBJ_ARR) {
+        ObjArr *arr = (ObjArr *)v.as.obj;
+        push(vm, arr->items[toindex(idx, arr->len)]);
+        return;
+    }
+    if (v.type == V_OBJ && v.as.obj->type == OBJ_BUF) {
+        ObjBuf *buf = (ObjBuf *)v.as.obj;
+        push(vm, numval(buf->data[toindex(idx, buf->len)]));
+        return;
     }
+    if (!isvstr(v))
+        starfail("can't index %s", typname(v));
+    int len;
+    strchars(v, &len);
+    push(vm, startrack(vm, sliceval(v, toindex(idx, len), 1)));
+}
+
+// storing one past the end appends to arrays, buffers don't grow
+static void setindex(Vm *vm, Value v, Value idx, Value item) {
+    if (v.type == V_OBJ && v.as.obj->type == OBJ_BUF) {
+        ObjBuf *buf = (ObjBuf *)v.as.obj;
+        if (item.type != V_NUM)
+            starfail("buffers hold numbers, got %s", typname(item));
+        buf->data[toindex(idx, buf->len)] = item.as.num;
+        return;
+    }
+    if (v.type == V_OBJ && v.as.obj->type == OBJ_TAB) {
+        ValTab *vt = ((ObjTab *)v.as.obj)->fields;
+        if (((ObjTab *)v.as.obj)->isproto) vm->epoch++;
+        if (idx.type == V_NUM)
+            valtabsetnum(vt, idx.as.num, item);
+        else if (isvstr(idx))
+            valtabset(vt, strobj(idx), item);
+        else
+            starfail("table keys have to be strings or numbers, got %s",
+                    typname(idx));
+        return;
+    }
+    if (v.type != V_OBJ || v.as.obj->type != OBJ_ARR)
+        starfail("can only store into arrays, buffers and tables, got %s",
+                typname(v));
+    ObjArr *arr = (ObjArr *)v.as.obj;
+    if (idx.type == V_NUM && idx.as.num == arr->len)
+        arrpush(arr, item);
+    else
+        arr->items[toindex(idx, arr->len)] = item;
+}
+
+static double length(Value v) {
+    if (v.type == V_OBJ && v.as.obj->type == OBJ_ARR)
+        return ((ObjArr *)v.as.obj)->len;
+    if (v.type == V_OBJ && v.as.obj->type == OBJ_BUF)
+        return ((ObjBuf *)v.as.obj)->len;
+    if (!isvstr(v))
+        starfail("can't take the length of %s", typname(v));
+    int len;
+    strchars(v, &len);
+    return len;
+}
+
+// a hit is checked against the key in the slot, so entries can't be
+// mixed up when a chunk is freed and another one takes its place
+static int cachehit(Vm *vm, FieldCache *fc, ObjTab *proto, char *name,
+        int len, unsigned hash) {
+    if (!fc || fc->proto != proto || fc->epoch != vm->epoch) return 0;
+    ObjString *key = strobj(fc->holder->fields->slots[fc->slot].key);
+    return key->hash == hash && key->len == len
+        && memcmp(key->str, name, len) == 0;
+}
+
+// fc is the cache entry of the instruction doing the lookup, if any
+static Value inherited(Vm *vm, ObjTab *proto, char *name, int len,
+        unsigned hash, FieldCache *fc) {
+    if (cachehit(vm, fc, proto, name, len, hash))
+        return fc->holder->fields->slots[fc->slot].value;
+    int depth = 0;
+    for (ObjTab *t = proto; t; t = t->proto) {
+        if (++depth > MAXPROTO)
+            starfail("prototype chain longer than %i", MAXPROTO);
+        int slot = valtabfind(t->fields, name, len, hash);
+        if (slot < 0) continue;
+        if (fc) *fc = (FieldCache){proto, t, slot, vm->epoch};
+        return t->fields->slots[slot].value;
+    }
+    return nilval();
+}
+
+static void pushfield(Vm *vm, Value vtab, Value vname, FieldCache *fc) {
+    if (vtab.type != V_OBJ || vtab.as.obj->type != OBJ_TAB)
+        starfail("only tables have fields");
+    if (!isvstr(vname))
+        starfail("field name has to be a string");
     ObjTab *tab = (ObjTab *)vtab.as.obj;
-    ObjString *name = (ObjString *)vname.as.obj;
+    int len;
+    char *name = strchars(vname, &len);
+    unsigned hash = strvhash(vname);
     Value tmp;
-    if (valtabget(tab->fields, name, &tmp))
+    if (valtabgetn(tab->fields, name, len, hash, &tmp))
         push(vm, tmp);
+    else if (tab->proto)
+        push(vm, inherited(vm, tab->proto, name, len, hash, fc));
     else
         push(vm, nilval());
 }
 
-static void runchunkoffset(Vm *vm, Chunk *c, int base) {
+static FieldCache *fieldcache(Vm *vm, Chunk *c, int ip) {
+    return &vm->fcache[((uintptr_t)&c->ins[ip] / sizeof(Ins)) % NFIELDCACHE];
+}
+
+// prof is a constant in each copy of the loop, the one without hooks
+// doesn't keep the call chain or time anything
+#define PROF_ENTER() \
+    ProfChunk *pc = prof && vm->prof ? profenter(vm->prof, c) : 0; \
+    int prevop = OP_NONE; \
+    volatile Frame *fr = &vm->frames[vm->nframes < MAXFRAMES ? vm->nframes : MAXFRAMES]; \
+    if (prof) { \
+        fr->chunk = c; \
+        fr->ip = 0; \
+        vm->nframes++; \
+    }
+#define PROF_LEAVE() if (prof) vm->nframes--
+#define PROF_BEGIN() \
+    if (prof) fr->ip = ip; \
+    uint64_t t0 = pc ? profclock() : 0; \
+    int pip = ip
+#define PROF_END() \
+    if (pc) { \
+        profins(vm->prof, pc, pip, i.op, prevop, t0); \
+        prevop = i.op; \
+    }
+#define PROF_CALL_BEGIN() uint64_t tc = pc ? profclock() : 0
+#define PROF_CALL_END() if (pc) vm->prof->callee = profclock() - tc
+#define PROF_CALL_NONE() if (pc) vm->prof->callee = 0
+
+static void runchunkoffset(Vm *vm, Chunk *c, int base);
+
+static inline __attribute__((always_inline))
+void runloop(Vm *vm, Chunk *c, int base, int prof) {
+    Value *regs = c->nregs ? alloca(c->nregs * sizeof(Value)) : 0;
+    PROF_ENTER();
     for (int ip = 0; ip < c->nins; ip++) {
         Ins i = c->ins[ip];
+        PROF_BEGIN();
         switch (i.op) {
         case OP_NOP: break;
-        case OP_RET: return;
+        case OP_RET:
+            PROF_END();
+            PROF_LEAVE();
+            return;
         case OP_CONS: push(vm, c->cons[i.arg]); break;
         case OP_NIL: push(vm, nilval()); break;
         case OP_TRUE: push(vm, boolval(1)); break;
         case OP_FALSE: push(vm, boolval(0)); break;
         case OP_NEW: {
-            Value v = (Value){V_OBJ, {.obj = (Obj *)alloctab()}};
-            push(vm, v);
+            ValTab *shape = 0;
+            if (i.arg) shape = ((ObjTab *)c->cons[i.arg - 1].as.obj)->fields;
+            push(vm, startrack(vm, OBJVAL(alloctab(shape))));
             break;
         }
         case OP_DUP: {
@@ -510,25 +988,80 @@ static void runchunkoffset(Vm *vm, Chunk *c, int base) {
             break;
         }
         case OP_GET_FIELD: {
-            pushfield(vm, pop(vm), c->cons[i.arg]);
+            pushfield(vm, pop(vm), c->cons[i.arg], fieldcache(vm, c, ip));
             break;
         }
         case OP_SET_FIELD:  {
             Value v = pop(vm);
             Value vtab = pop(vm);
             Value vname = c->cons[i.arg];
+            if (vtab.type != V_OBJ || vtab.as.obj->type != OBJ_TAB)
+                starfail("only tables have fields");
             ObjTab *tab = (ObjTab *)vtab.as.obj;
-            ObjString *name = (ObjString *)vname.as.obj;
-            valtabset(tab->fields, name, v);
+            if (tab->isproto) vm->epoch++;
+            valtabset(tab->fields, strobj(vname), v);
             push(vm, v);
             break;
         }
-        case OP_NEG: {
+        case OP_ARR: {
+            Value arr = arrval(i.arg);
+            ObjArr *o = (ObjArr *)arr.as.obj;
+            vm->nstack -= i.arg;
+            memcpy(o->items, vm->stack + vm->nstack, i.arg * sizeof(Value));
+            o->len = i.arg;
+            push(vm, startrack(vm, arr));
+            break;
+        }
+        case OP_GET_INDEX: {
+            Value idx = pop(vm);
+            pushindex(vm, pop(vm), idx);
+            break;
+        }
+        case OP_SET_INDEX: {
             Value v = pop(vm);
-            if (v.type != V_NUM) {
-                printf("*** can only negate numbers\n");
-                exit(1);
+            Value idx = pop(vm);
+            setindex(vm, pop(vm), idx, v);
+            push(vm, v);
+            break;
+        }
+        case OP_DELETE: {
+            Value idx = pop(vm);
+            delindex(vm, pop(vm), idx);
+            break;
+        }
+        case OP_LEN: {
+            push(vm, numval(length(pop(vm))));
+            break;
+        }
+        case OP_ITER: {
+            // a for loop's array, position and variable, the top three locals
+            Value *it = vm->stack + vm->nstack - 3;
+            if (it[0].type == V_OBJ && it[0].as.obj->type == OBJ_BUF) {
+                ObjBuf *buf = (ObjBuf *)it[0].as.obj;
+                if (it[1].as.num >= buf->len) {
+                    ip += i.arg - 1;
+                    break;
+                }
+                it[2] = numval(buf->data[(int)it[1].as.num]);
+                it[1].as.num++;
+                break;
             }
+            if (it[0].type != V_OBJ || it[0].as.obj->type != OBJ_ARR)
+                starfail("can only iterate arrays and buffers, got %s",
+                        typname(it[0]));
+            ObjArr *arr = (ObjArr *)it[0].as.obj;
+            if (it[1].as.num >= arr->len) {
+                ip += i.arg - 1; // account for ip++
+                break;
+            }
+            it[2] = arr->items[(int)it[1].as.num];
+            it[1].as.num++;
+            break;
+        }
+        case OP_NEG: {
+            Value v = pop(vm);
+            if (v.type != V_NUM)
+                starfail("can only negate numbers");
             push(vm, numval(-v.as.num));
             break;
         }
@@ -546,15 +1079,55 @@ static void runchunkoffset(Vm *vm, Chunk *c, int base) {
                 ip += i.arg - 1; // account for ip++
             break;
         }
+        // the left operand is the result when it decides, otherwise
+        // it's dropped for the right one
+        case OP_AND: {
+            if (!istrue(peek(vm, 0)))
+                ip += i.arg - 1;
+            else
+                vm->nstack--;
+            break;
+        }
+        case OP_OR: {
+            if (istrue(peek(vm, 0)))
+                ip += i.arg - 1;
+            else
+                vm->nstack--;
+            break;
+        }
+        // skips the jump to the plain call while the field still holds
+        // the function that was inlined after it
+        case OP_GUARD: {
+            Value v = peek(vm, 0);
+            if (v.type == V_OBJ && v.as.obj == c->cons[i.arg].as.obj)
+                ip++;
+            break;
+        }
+        // an inlined call's result replaces its function, arguments and
+        // temporaries
+        case OP_SLIDE: {
+            Value v = vm->stack[vm->nstack - 1];
+            vm->nstack -= i.arg;
+            vm->stack[vm->nstack - 1] = v;
+            break;
+        }
+        // fields of a table that was never made, the stack slot below
+        // holds nil in its place
+        case OP_GET_REG:
+            vm->stack[vm->nstack - 1] = regs[i.arg];
+            break;
+        case OP_SET_REG:
+            regs[i.arg] = vm->stack[vm->nstack - 1];
+            vm->stack[vm->nstack - 2] = regs[i.arg];
+            vm->nstack--;
+            break;
         case OP_ADD:
         case OP_SUB:
         case OP_MUL:
         case OP_DIV: 
         case OP_LT: 
         case OP_GT:
-        case OP_EQ: 
-        case OP_AND: 
-        case OP_OR: {
+        case OP_EQ: {
             Value r = pop(vm);
             Value l = pop(vm);
             binop(vm, l, r, i.op);
@@ -566,29 +1139,114 @@ static void runchunkoffset(Vm *vm, Chunk *c, int base) {
             break;
         case OP_CALL: {
             Value vfn = peek(vm, i.arg);
-            ObjFunc *fn = (ObjFunc *)vfn.as.obj;
-            if (vfn.type != V_OBJ || fn->hdr.type != OBJ_FUNC) {
-                printf("*** can't call non-function\n");
-                exit(1);
-            }
-            if (fn->arity != i.arg) {
-                printf("*** expected %i args, got %i\n", fn->arity, i.arg);
-                exit(1);
+            if (vfn.type == V_OBJ && vfn.as.obj->type == OBJ_NATIVE) {
+                // runs on the arguments where they are, no frame
+                ObjNative *n = (ObjNative *)vfn.as.obj;
+                if (n->arity != i.arg)
+                    starfail("%s expects %i args, got %i",
+                            n->name, n->arity, i.arg);
+                Value rval = n->fn(vm, vm->stack + vm->nstack - i.arg);
+                vm->nstack -= i.arg;
+                vm->stack[vm->nstack - 1] = rval;
+                PROF_CALL_NONE();
+                break;
             }
+            if (vfn.type != V_OBJ || vfn.as.obj->type != OBJ_FUNC)
+                starfail("can't call non-function");
+            ObjFunc *fn = (ObjFunc *)vfn.as.obj;
+            if (fn->arity != i.arg)
+                starfail("expected %i args, got %i", fn->arity, i.arg);
+            if (__atomic_load_n(&fn->lazy, __ATOMIC_ACQUIRE))
+                compilelazy(fn);
             int firstarg = vm->nstack - fn->arity;
+            PROF_CALL_BEGIN();
             runchunkoffset(vm, fn->chunk, firstarg);
+            PROF_CALL_END();
             Value rval = pop(vm);
             vm->nstack = firstarg - 1;
             push(vm, rval);
             break;
         }
         default:
-            printf("*** can't execute %s\n", opname(i.op));
-            exit(1);
+            starfail("can't execute %s", opname(i.op));
         }
+        PROF_END();
+    }
+    PROF_LEAVE();
+}
+
+// the hooks cost every instruction, so calls only go through the copy
+// with them while a profile or a sampler is attached
+static void runchunkoffset(Vm *vm, Chunk *c, int base) {
+#ifdef STAR_PROF
+    if (vm->prof || vm->sampling) {
+        runloop(vm, c, base, 1);
+        return;
     }
+#endif
+    runloop(vm, c, base, 0);
 }
 
 void runchunk(Vm *vm, Chunk *c) {
     runchunkoffset(vm, c, 0);
 }
+
+int starcompilen(Vm *vm, char *src, size_t len, Scope *scope, int keep,
+        ObjFunc **fn) {
+    ErrJmp ej;
+    pusherr(&ej);
+    if (setjmp(ej.jb)) {
+        strcpy(vm->err, ej.msg);
+        *fn = 0;
+        return STAR_ERR;
+    }
+    *fn = compilen(src, len, scope, keep);
+    poperr(&ej);
+    return STAR_OK;
+}
+
+int starcompilefp(Vm *vm, FILE *fp, Scope *scope, int keep, ObjFunc **fn) {
+    ErrJmp ej;
+    pusherr(&ej);
+    if (setjmp(ej.jb)) {
+        strcpy(vm->err, ej.msg);
+        *fn = 0;
+        return STAR_ERR;
+    }
+    *fn = compilefp(fp, scope, keep);
+    poperr(&ej);
+    return STAR_OK;
+}
+
+int starcompilein(Vm *vm, char *src, Scope *scope, int keep, ObjFunc **fn) {
+    return starcompilen(vm, src, strlen(src), scope, keep, fn);
+}
+
+int starcompile(Vm *vm, char *src, ObjFunc **fn) {
+    return starcompilein(vm, src, 0, 0, fn);
+}
+
+// the stack is left as the script left it, the result is the top value
+int starrun(Vm *vm, ObjFunc *fn) {
+    ErrJmp ej;
+    vm->nstack = vm->nbase;
+    vm->nframes = 0;
+    pusherr(&ej);
+    if (setjmp(ej.jb)) {
+        strcpy(vm->err, ej.msg);
+        vm->nstack = vm->nbase;
+        vm->nframes = 0;
+        return STAR_ERR;
+    }
+    runchunk(vm, fn->chunk);
+    poperr(&ej);
+    return STAR_OK;
+}
+
+Value starresult(Vm *vm) {
+    return vm->nstack ? vm->stack[vm->nstack - 1] : nilval();
+}
+
+char *starerror(Vm *vm) {
+    return vm->err;
+}
@@ -1,3 +1,6 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <star/mem.h>
 #include <star/util.h>
@@ -98,3 +101,38 @@ unsigned strhash(char *str) {
         hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
     return hash;
 }
+
+unsigned strhashn(char *str, int len) {
+    int hash = 5381;
+    for (int i = 0; i < len; i++)
+        hash = ((hash << 5) + hash) + str[i];
+    return hash;
+}
+
+static _Thread_local ErrJmp *errjmp = 0;
+
+void pusherr(ErrJmp *ej) {
+    ej->msg[0] = 0;
+    ej->prev = errjmp;
+    errjmp = ej;
+}
+
+void poperr(ErrJmp *ej) {
+    errjmp = ej->prev;
+}
+
+void starfail(char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    if (!errjmp) {
+        printf("*** ");
+        vprintf(fmt, ap);
+        printf("\n");
+        exit(1);
+    }
+    ErrJmp *ej = errjmp;
+    errjmp = ej->prev;
+    vsnprintf(ej->msg, sizeof(ej->msg), fmt, ap);
+    va_end(ap);
+    longjmp(ej->jb, 1);
+}
@@ -1,25 +1,36 @@
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <star/star.h>
 #include <star/mem.h>
+#include <star/util.h>
 
-typedef struct Entry Entry;
-struct Entry {
-    ObjString *key;
-    Value value;
-};
-
-struct ValTab {
-    Entry *slots;
-    int nslots;
-    int nused;
-};
-
-int valtabnext(ValTab *vt, int idx, ObjString **key, Value *dst) {
-    for (; idx < vt->nslots; idx++) {
-        Entry *e = &vt->slots[idx];
-        if (!e->key) continue;
+// whole numbers up to this go in the array part when it's dense enough
+#define MAXARRBITS 30
+
+// tables shrink when less than an eighth of this much room is in use
+#define MINSHRINK 16
+
+int valtabcount(ValTab *vt) {
+    return vt->nused + vt->narrused;
+}
+
+static int live(Slot *e) {
+    return e->key.type != V_NONE && e->key.type != V_DEAD;
+}
+
+// the array part first, then the hash part
+int valtabnext(ValTab *vt, int idx, Value *key, Value *dst) {
+    for (; idx < vt->narr; idx++) {
+        if (vt->arr[idx].type == V_NONE) continue;
+        *key = numval(idx);
+        *dst = vt->arr[idx];
+        return idx + 1;
+    }
+    for (; idx < vt->narr + vt->nslots; idx++) {
+        Slot *e = &vt->slots[idx - vt->narr];
+        if (!live(e)) continue;
         *key = e->key;
         *dst = e->value;
         return idx + 1;
@@ -33,61 +44,270 @@ ValTab *newvaltab() {
     return vt;
 }
 
+// same slots, so the copy doesn't rehash as its keys are set again
+ValTab *copyvaltab(ValTab *vt) {
+    ValTab *cp = newvaltab();
+    cp->nslots = vt->nslots;
+    cp->nused = vt->nused;
+    cp->ndead = vt->ndead;
+    cp->narr = vt->narr;
+    cp->narrused = vt->narrused;
+    if (vt->nslots) {
+        cp->slots = xmalloc(vt->nslots * sizeof(Slot));
+        memcpy(cp->slots, vt->slots, vt->nslots * sizeof(Slot));
+    }
+    if (vt->narr) {
+        cp->arr = xmalloc(vt->narr * sizeof(Value));
+        memcpy(cp->arr, vt->arr, vt->narr * sizeof(Value));
+    }
+    return cp;
+}
+
 void freevaltab(ValTab *vt) {
-    if (vt->slots) xfree(vt->slots);
+    if (!vt->mapped) {
+        if (vt->slots) xfree(vt->slots);
+        if (vt->arr) xfree(vt->arr);
+    }
     xfree(vt);
 }
 
-static int keycmp(ObjString *a, ObjString *b) {
-    if (!a || !b) return 0;
-    if (a->hash != b->hash) return 0;
-    if (a->len != b->len) return 0;
-    if (strcmp(a->str, b->str) != 0) return 0;
+static ObjString *keystr(Value key) {
+    return key.type == V_OBJ ? (ObjString *)key.as.obj : 0;
+}
+
+static int keycmpn(Value a, char *str, int len, unsigned hash) {
+    ObjString *s = keystr(a);
+    if (!s) return 0;
+    if (s->hash != hash) return 0;
+    if (s->len != len) return 0;
+    if (memcmp(s->str, str, len) != 0) return 0;
+    return 1;
+}
+
+static unsigned numhash(double k) {
+    uint64_t bits;
+    if (k == 0) k = 0; // -0 and 0 are the same key
+    memcpy(&bits, &k, sizeof(bits));
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdull;
+    bits ^= bits >> 33;
+    return bits;
+}
+
+static unsigned keyhash(Value key) {
+    return key.type == V_NUM ? numhash(key.as.num) : keystr(key)->hash;
+}
+
+static int keycmp(Value a, Value b) {
+    if (b.type == V_NUM) return a.type == V_NUM && a.as.num == b.as.num;
+    ObjString *s = keystr(b);
+    return keycmpn(a, s->str, s->len, s->hash);
+}
+
+// -1 for anything that can't go in the array part
+static int arrindex(double k) {
+    if (!(k >= 0 && k < 1 << MAXARRBITS) || k != (int)k) return -1;
+    return k;
+}
+
+// the slot key is in, -1 when it's missing. Deleted keys leave a
+// tombstone behind, so a probe only misses at an empty slot
+int valtabfind(ValTab *vt, char *key, int len, unsigned hash) {
+    for (int i = 0; i < vt->nslots; i++) {
+        int idx = (hash + i) % vt->nslots;
+        Slot *e = &vt->slots[idx];
+        if (e->key.type == V_NONE) return -1;
+        if (keycmpn(e->key, key, len, hash)) return idx;
+    }
+    return -1;
+}
+
+int valtabgetn(ValTab *vt, char *key, int len, unsigned hash, Value *dst) {
+    int idx = valtabfind(vt, key, len, hash);
+    if (idx < 0) return 0;
+    *dst = vt->slots[idx].value;
     return 1;
 }
 
 int valtabget(ValTab *vt, ObjString *key, Value *dst) {
+    return valtabgetn(vt, key->str, key->len, key->hash, dst);
+}
+
+// keys in the array part are a direct index, no hashing
+int valtabgetnum(ValTab *vt, double key, Value *dst) {
+    int k = arrindex(key);
+    if (k >= 0 && k < vt->narr) {
+        *dst = vt->arr[k];
+        return dst->type != V_NONE;
+    }
     if (!vt->nslots) return 0;
+    unsigned hash = numhash(key);
     for (int i = 0; i < vt->nslots; i++) {
-        int idx = (key->hash + i) % vt->nslots;
-        Entry *e = &vt->slots[idx];
-        if (!keycmp(e->key, key)) continue;
+        Slot *e = &vt->slots[(hash + i) % vt->nslots];
+        if (e->key.type == V_NONE) return 0;
+        if (e->key.type != V_NUM || e->key.as.num != key) continue;
         *dst = e->value;
         return 1;
     }
     return 0;
 }
 
-void valtabset(ValTab *vt, ObjString *key, Value v);
+static void setkey(ValTab *vt, Value key, Value v);
+
+// nums[b] counts the whole number keys in [2^(b-1), 2^b), nums[0] the 0s
+static void countkey(Value key, int *nums, int *nints) {
+    if (key.type != V_NUM) return;
+    int k = arrindex(key.as.num);
+    if (k < 0) return;
+    int b = 0;
+    while (k >= 1 << b) b++;
+    nums[b]++;
+    (*nints)++;
+}
 
-static void grow(ValTab *vt) {
+// the array part becomes the largest power of two more than half of
+// which would be in use, the hash part gets everything else with room
+// to spare. extra is the key about to be added, if any. Tombstones are
+// dropped, so this is also how tables shrink
+static void rehash(ValTab *vt, Value extra) {
+    int nums[MAXARRBITS + 1] = {0};
+    int nints = 0, nkeys = extra.type != V_NONE;
+    for (int i = 0; i < vt->narr; i++) {
+        if (vt->arr[i].type == V_NONE) continue;
+        countkey(numval(i), nums, &nints);
+        nkeys++;
+    }
+    for (int i = 0; i < vt->nslots; i++) {
+        if (!live(&vt->slots[i])) continue;
+        countkey(vt->slots[i].key, nums, &nints);
+        nkeys++;
+    }
+    countkey(extra, nums, &nints);
+    int narr = 0, ninarr = 0, below = 0;
+    for (int b = 0, size = 1; b <= MAXARRBITS && size / 2 < nints; b++, size *= 2) {
+        below += nums[b];
+        if (below > size / 2) {
+            narr = size;
+            ninarr = below;
+        }
+    }
     ValTab old = *vt;
-    vt->nslots = vt->nslots ? vt->nslots * 2 : 8;
-    // printf("grow %i -> %i\n", old.nslots, vt->nslots);
-    vt->slots = xmalloc(vt->nslots * sizeof(Entry));
-    memset(vt->slots, 0, vt->nslots * sizeof(Entry));
+    vt->narr = narr;
+    vt->arr = narr ? xmalloc(narr * sizeof(Value)) : 0;
+    if (narr) memset(vt->arr, 0, narr * sizeof(Value));
+    int nslots = 0;
+    while (nslots / 2 < nkeys - ninarr) nslots = nslots ? nslots * 2 : 8;
+    vt->nslots = nslots;
+    vt->slots = nslots ? xmalloc(nslots * sizeof(Slot)) : 0;
+    if (nslots) memset(vt->slots, 0, nslots * sizeof(Slot));
     vt->nused = 0;
+    vt->ndead = 0;
+    vt->narrused = 0;
+    vt->mapped = 0;
+    for (int i = 0; i < old.narr; i++)
+        if (old.arr[i].type != V_NONE) setkey(vt, numval(i), old.arr[i]);
     for (int i = 0; i < old.nslots; i++) {
-        Entry *e = &old.slots[i];
-        if (!e->key) continue;
-        valtabset(vt, e->key, e->value);
+        Slot *e = &old.slots[i];
+        if (live(e)) setkey(vt, e->key, e->value);
+    }
+    if (!old.mapped) {
+        if (old.slots) xfree(old.slots);
+        if (old.arr) xfree(old.arr);
     }
-    if (old.slots) xfree(old.slots);
 }
 
-void valtabset(ValTab *vt, ObjString *key, Value v) {
-    if (vt->nused + 1 > vt->nslots / 2)
-        grow(vt);
+static int setarr(ValTab *vt, Value key, Value v) {
+    if (key.type != V_NUM) return 0;
+    int k = arrindex(key.as.num);
+    if (k < 0 || k >= vt->narr) return 0;
+    if (vt->arr[k].type == V_NONE) vt->narrused++;
+    vt->arr[k] = v;
+    return 1;
+}
+
+// where key is in the hash part, -1 when it's missing
+static int findkey(ValTab *vt, Value key) {
+    unsigned hash = keyhash(key);
+    for (int i = 0; i < vt->nslots; i++) {
+        int idx = (hash + i) % vt->nslots;
+        Slot *e = &vt->slots[idx];
+        if (e->key.type == V_NONE) return -1;
+        if (live(e) && keycmp(e->key, key)) return idx;
+    }
+    return -1;
+}
+
+// a new key takes the first tombstone on its probe, tombstones count
+// towards the load so misses stay short
+static void setkey(ValTab *vt, Value key, Value v) {
+    if (setarr(vt, key, v)) return;
+    if (vt->nused + vt->ndead + 1 > vt->nslots / 2)
+        rehash(vt, key);
+    // rehashing can have made room for it in the array part
+    if (setarr(vt, key, v)) return;
+    unsigned hash = keyhash(key);
+    Slot *dead = 0;
     for (int i = 0; i < vt->nslots; i++) {
-        int idx = (key->hash + i) % vt->nslots;
-        Entry *e = &vt->slots[idx];
-        if (e->key && !keycmp(e->key, key)) continue;
-        if (!e->key) vt->nused++;
-        // printf("set at +%i\n", i);
+        int idx = (hash + i) % vt->nslots;
+        Slot *e = &vt->slots[idx];
+        if (e->key.type == V_DEAD) {
+            if (!dead) dead = e;
+            continue;
+        }
+        if (e->key.type != V_NONE && !keycmp(e->key, key)) continue;
+        if (e->key.type == V_NONE) {
+            if (dead) {
+                e = dead;
+                vt->ndead--;
+            }
+            vt->nused++;
+        }
         e->key = key;
         e->value = v;
         return;
     }
-    printf("*** out of free slots\n");
-    exit(1);
+    starfail("out of free slots");
+}
+
+static void shrink(ValTab *vt) {
+    int room = vt->nslots + vt->narr;
+    if (room > MINSHRINK && valtabcount(vt) * 8 < room)
+        rehash(vt, (Value){V_NONE});
+}
+
+// a deleted key in the hash part leaves a tombstone so probes for keys
+// placed after it still find them
+static void delkey(ValTab *vt, Value key) {
+    int k = key.type == V_NUM ? arrindex(key.as.num) : -1;
+    if (k >= 0 && k < vt->narr) {
+        if (vt->arr[k].type == V_NONE) return;
+        vt->arr[k] = (Value){V_NONE};
+        vt->narrused--;
+    }
+    else {
+        int idx = findkey(vt, key);
+        if (idx < 0) return;
+        vt->slots[idx] = (Slot){.key = {V_DEAD}, .value = {V_NIL}};
+        vt->nused--;
+        vt->ndead++;
+    }
+    shrink(vt);
+}
+
+void valtabset(ValTab *vt, ObjString *key, Value v) {
+    setkey(vt, OBJVAL(key), v);
+}
+
+void valtabsetnum(ValTab *vt, double key, Value v) {
+    if (key != key)
+        starfail("table key can't be NaN");
+    setkey(vt, numval(key), v);
+}
+
+void valtabdel(ValTab *vt, ObjString *key) {
+    delkey(vt, OBJVAL(key));
+}
+
+void valtabdelnum(ValTab *vt, double key) {
+    if (key == key) delkey(vt, numval(key));
 }